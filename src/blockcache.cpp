@@ -0,0 +1,66 @@
+// Copyright (c) 2018 The KORE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcache.h"
+
+#include "core_memusage.h"
+
+CBlockCache blockCache(DEFAULT_BLOCK_CACHE_SIZE << 20);
+
+void CBlockCache::Trim()
+{
+    AssertLockHeld(cs);
+    while (nUsage > nMaxUsage && !listRecent.empty()) {
+        nUsage -= listRecent.back().nUsage;
+        mapBlocks.erase(listRecent.back().hash);
+        listRecent.pop_back();
+    }
+}
+
+void CBlockCache::SetMaxUsage(size_t nMaxUsageIn)
+{
+    LOCK(cs);
+    nMaxUsage = nMaxUsageIn;
+    Trim();
+}
+
+boost::shared_ptr<const CBlock> CBlockCache::Get(const uint256& hash)
+{
+    LOCK(cs);
+    std::map<uint256, EntryList::iterator>::iterator it = mapBlocks.find(hash);
+    if (it == mapBlocks.end())
+        return boost::shared_ptr<const CBlock>();
+    listRecent.splice(listRecent.begin(), listRecent, it->second);
+    return it->second->pblock;
+}
+
+void CBlockCache::Insert(const uint256& hash, const boost::shared_ptr<const CBlock>& pblock)
+{
+    LOCK(cs);
+    if (nMaxUsage == 0 || mapBlocks.count(hash))
+        return;
+
+    CEntry entry;
+    entry.hash = hash;
+    entry.pblock = pblock;
+    entry.nUsage = sizeof(CBlock) + RecursiveDynamicUsage(*pblock);
+    listRecent.push_front(entry);
+    mapBlocks.insert(std::make_pair(hash, listRecent.begin()));
+    nUsage += entry.nUsage;
+    Trim();
+}
+
+void CBlockCache::Clear()
+{
+    LOCK(cs);
+    listRecent.clear();
+    mapBlocks.clear();
+    nUsage = 0;
+}
+
+size_t CBlockCache::DynamicMemoryUsage()
+{
+    LOCK(cs);
+    return nUsage;
+}
@@ -0,0 +1,63 @@
+// Copyright (c) 2018 The KORE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef KORE_BLOCKCACHE_H
+#define KORE_BLOCKCACHE_H
+
+#include "primitives/block.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <list>
+#include <map>
+
+#include <boost/shared_ptr.hpp>
+
+/** Default for -blockcachesize, the memory (in MiB) used to keep recently used blocks deserialized */
+static const unsigned int DEFAULT_BLOCK_CACHE_SIZE = 32;
+
+/**
+ * Byte-bounded LRU of deserialized blocks keyed by block hash. Blocks near the
+ * tip are requested over and over (by peers, getblock, REST, wallet rescans and
+ * the block explorer); sharing one immutable copy avoids reading and
+ * deserializing them for every request.
+ */
+class CBlockCache
+{
+private:
+    struct CEntry {
+        uint256 hash;
+        boost::shared_ptr<const CBlock> pblock;
+        size_t nUsage;
+    };
+    typedef std::list<CEntry> EntryList;
+
+    CCriticalSection cs;
+    size_t nMaxUsage;
+    size_t nUsage;
+    //! Most recently used first
+    EntryList listRecent;
+    std::map<uint256, EntryList::iterator> mapBlocks;
+
+    void Trim();
+
+public:
+    explicit CBlockCache(size_t nMaxUsageIn) : nMaxUsage(nMaxUsageIn), nUsage(0) {}
+
+    /** Change the memory bound, 0 disables the cache */
+    void SetMaxUsage(size_t nMaxUsageIn);
+
+    /** Return the cached block with this hash, or an empty pointer */
+    boost::shared_ptr<const CBlock> Get(const uint256& hash);
+
+    void Insert(const uint256& hash, const boost::shared_ptr<const CBlock>& pblock);
+
+    void Clear();
+
+    size_t DynamicMemoryUsage();
+};
+
+extern CBlockCache blockCache;
+
+#endif // KORE_BLOCKCACHE_H
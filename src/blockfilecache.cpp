@@ -0,0 +1,114 @@
+// Copyright (c) 2018 The KORE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilecache.h"
+
+#include "chainparams.h"
+#include "compat.h"
+#include "main.h"
+#include "util.h"
+
+#ifndef WIN32
+#include <sys/stat.h>
+#endif
+
+CBlockFileCache blockFileCache(MAX_MAPPED_BLOCK_FILES);
+
+CMappedBlockFile::~CMappedBlockFile()
+{
+#ifndef WIN32
+    munmap((void*)pbegin, nSize);
+#endif
+}
+
+boost::shared_ptr<const CMappedBlockFile> CBlockFileCache::GetFile(const FileKey& key, size_t nMinSize)
+{
+    AssertLockHeld(cs);
+
+    FileMap::iterator it = mapFiles.find(key);
+    if (it != mapFiles.end()) {
+        listRecent.splice(listRecent.begin(), listRecent, it->second.second);
+        if (it->second.first->size() >= nMinSize)
+            return it->second.first;
+        // The file grew since it was mapped, map it again below
+        listRecent.erase(it->second.second);
+        mapFiles.erase(it);
+    }
+
+#ifdef WIN32
+    return boost::shared_ptr<const CMappedBlockFile>();
+#else
+    CDiskBlockPos pos(key.second, 0);
+    boost::filesystem::path path = GetBlockPosFilename(pos, key.first.c_str());
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return boost::shared_ptr<const CMappedBlockFile>();
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < nMinSize) {
+        close(fd);
+        return boost::shared_ptr<const CMappedBlockFile>();
+    }
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        LogPrint("db", "%s : unable to map %s\n", __func__, path.string());
+        return boost::shared_ptr<const CMappedBlockFile>();
+    }
+
+    boost::shared_ptr<const CMappedBlockFile> file(new CMappedBlockFile((const char*)p, st.st_size));
+    listRecent.push_front(key);
+    mapFiles.insert(std::make_pair(key, std::make_pair(file, listRecent.begin())));
+    while (mapFiles.size() > nMaxFiles) {
+        // Readers still holding an evicted file keep it mapped until they are done
+        mapFiles.erase(listRecent.back());
+        listRecent.pop_back();
+    }
+    return file;
+#endif
+}
+
+bool CBlockFileCache::Open(const CDiskBlockPos& pos, const char* prefix, unsigned int nTrailer, CBlockFileReader& reader)
+{
+    // Every record is preceded by the network magic and its serialized size
+    if (pos.IsNull() || pos.nPos < MESSAGE_START_SIZE + sizeof(unsigned int))
+        return false;
+
+    boost::shared_ptr<const CMappedBlockFile> file;
+    {
+        LOCK(cs);
+        file = GetFile(std::make_pair(std::string(prefix), pos.nFile), pos.nPos);
+    }
+    if (!file)
+        return false;
+
+    const char* pheader = file->begin() + pos.nPos - MESSAGE_START_SIZE - sizeof(unsigned int);
+    if (memcmp(pheader, Params().MessageStart(), MESSAGE_START_SIZE))
+        return error("%s : no record at %s%05u.dat position %u", __func__, prefix, pos.nFile, pos.nPos);
+    unsigned int nSize;
+    memcpy(&nSize, pheader + MESSAGE_START_SIZE, sizeof(nSize));
+
+    uint64_t nEnd = (uint64_t)pos.nPos + nSize + nTrailer;
+    if (nEnd > file->size()) {
+        LOCK(cs);
+        file = GetFile(std::make_pair(std::string(prefix), pos.nFile), nEnd);
+        if (!file)
+            return false;
+    }
+
+    reader.Init(file, file->begin() + pos.nPos, file->begin() + nEnd);
+    return true;
+}
+
+void CBlockFileCache::Erase(int nFile)
+{
+    LOCK(cs);
+    for (FileMap::iterator it = mapFiles.begin(); it != mapFiles.end();) {
+        if (it->first.second == nFile) {
+            listRecent.erase(it->second.second);
+            mapFiles.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
@@ -0,0 +1,141 @@
+// Copyright (c) 2018 The KORE developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef KORE_BLOCKFILECACHE_H
+#define KORE_BLOCKFILECACHE_H
+
+#include "serialize.h"
+#include "sync.h"
+
+#include <list>
+#include <map>
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+
+struct CDiskBlockPos;
+
+/** Maximum number of blk?????.dat/rev?????.dat files kept mapped by the block file cache */
+static const size_t MAX_MAPPED_BLOCK_FILES = 16;
+
+/** A read-only memory mapping of a whole blk?????.dat or rev?????.dat file */
+class CMappedBlockFile
+{
+private:
+    // Disallow copies
+    CMappedBlockFile(const CMappedBlockFile&);
+    CMappedBlockFile& operator=(const CMappedBlockFile&);
+
+    const char* pbegin;
+    size_t nSize;
+
+public:
+    CMappedBlockFile(const char* pbeginIn, size_t nSizeIn) : pbegin(pbeginIn), nSize(nSizeIn) {}
+    ~CMappedBlockFile();
+
+    const char* begin() const { return pbegin; }
+    size_t size() const { return nSize; }
+};
+
+/**
+ * Stream over one record (a block, or an undo record and its checksum) in a
+ * mapped block file. Deserializes straight from the mapping, which it keeps
+ * alive for as long as the reader exists.
+ */
+class CBlockFileReader
+{
+private:
+    boost::shared_ptr<const CMappedBlockFile> file;
+    const char* pcur;
+    const char* pend;
+    int nType;
+    int nVersion;
+
+public:
+    CBlockFileReader(int nTypeIn, int nVersionIn) : pcur(NULL), pend(NULL), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    void Init(const boost::shared_ptr<const CMappedBlockFile>& fileIn, const char* pbegin, const char* pendIn)
+    {
+        file = fileIn;
+        pcur = pbegin;
+        pend = pendIn;
+    }
+
+    bool IsNull() const { return !file; }
+
+    /** The unread bytes of the record, valid for as long as the reader exists */
+    const char* data() const { return pcur; }
+    size_t size() const { return pend - pcur; }
+
+    //
+    // Stream subset
+    //
+    int GetType() { return nType; }
+    int GetVersion() { return nVersion; }
+
+    CBlockFileReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > (size_t)(pend - pcur))
+            throw std::ios_base::failure("CBlockFileReader::read : end of record");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    CBlockFileReader& ignore(size_t nSize)
+    {
+        if (nSize > (size_t)(pend - pcur))
+            throw std::ios_base::failure("CBlockFileReader::ignore : end of record");
+        pcur += nSize;
+        return (*this);
+    }
+
+    template <typename T>
+    CBlockFileReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+/**
+ * Bounded LRU of memory mapped block and undo files. Reads through it avoid
+ * the fopen/fseek/fclose round trip of OpenDiskFile for every block, undo
+ * record or indexed transaction that is looked up. Files that grew since they
+ * were mapped are remapped on demand. On platforms without mmap Open() always
+ * fails and callers fall back to reading through OpenDiskFile.
+ */
+class CBlockFileCache
+{
+private:
+    typedef std::pair<std::string, int> FileKey;
+    typedef std::list<FileKey> FileList;
+    typedef std::map<FileKey, std::pair<boost::shared_ptr<const CMappedBlockFile>, FileList::iterator> > FileMap;
+
+    CCriticalSection cs;
+    size_t nMaxFiles;
+    //! Most recently used first
+    FileList listRecent;
+    FileMap mapFiles;
+
+    boost::shared_ptr<const CMappedBlockFile> GetFile(const FileKey& key, size_t nMinSize);
+
+public:
+    explicit CBlockFileCache(size_t nMaxFilesIn) : nMaxFiles(nMaxFilesIn) {}
+
+    /**
+     * Point reader at the record stored at pos, as written by WriteBlockToDisk or
+     * CBlockUndo::WriteToDisk. nTrailer is the number of bytes that follow the
+     * serialized record (the checksum of undo records).
+     */
+    bool Open(const CDiskBlockPos& pos, const char* prefix, unsigned int nTrailer, CBlockFileReader& reader);
+
+    /** Drop the mappings of a file, e.g. after it was pruned */
+    void Erase(int nFile);
+};
+
+extern CBlockFileCache blockFileCache;
+
+#endif // KORE_BLOCKFILECACHE_H
@@ -67,6 +67,27 @@ const CBlockIndex* CChain::FindFork(const CBlockIndex* pindex) const
     return pindex;
 }
 
+void* CBlockIndexArena::Allocate()
+{
+    if (nUsedInLastChunk == CHUNK_ENTRIES) {
+        vChunks.push_back(static_cast<CBlockIndex*>(::operator new(sizeof(CBlockIndex) * CHUNK_ENTRIES)));
+        nUsedInLastChunk = 0;
+    }
+    return vChunks.back() + nUsedInLastChunk++;
+}
+
+void CBlockIndexArena::Clear()
+{
+    for (size_t i = 0; i < vChunks.size(); i++) {
+        size_t nUsed = (i + 1 == vChunks.size()) ? nUsedInLastChunk : CHUNK_ENTRIES;
+        for (size_t j = 0; j < nUsed; j++)
+            vChunks[i][j].~CBlockIndex();
+        ::operator delete(vChunks[i]);
+    }
+    vChunks.clear();
+    nUsedInLastChunk = CHUNK_ENTRIES;
+}
+
 uint256 CBlockIndex::GetBlockTrust() const
 {
     uint256 bnTarget;
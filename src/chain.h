@@ -104,6 +104,7 @@ enum BlockStatus {
     BLOCK_FAILED_CHILD       = 64, //! descends from failed block
     BLOCK_FAILED_MASK        = BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
     BLOCK_PROOF_OF_STAKE     = 128, //! is proof-of-stake block
+    BLOCK_HAVE_SNAPSHOT      = 256, //! chain state up to here was loaded from a UTXO snapshot, block data may be missing
 };
 
 /** The block chain is a tree shaped structure starting with the
@@ -114,35 +115,38 @@ enum BlockStatus {
 class CBlockIndex
 {
 public:
+    // Hot fields first: everything chain selection, skip-list walks, difficulty
+    // retargeting and stake modifier computation touch fits in the first two
+    // cache lines of an entry.
+
     //! pointer to the hash of the block, if any. memory is owned by this CBlockIndex
     const uint256* phashBlock;
 
     //! pointer to the index of the predecessor of this block
     CBlockIndex* pprev;
 
-    //! pointer to the index of the next block
-    CBlockIndex* pnext;
-
     //! pointer to the index of some further predecessor of this block
     CBlockIndex* pskip;
 
-    //ppcoin: trust score of block chain
-    uint256 bnChainTrust;
-
     //! height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
-    //! Which # file this block is stored in (blk?????.dat)
-    int nFile;
-
-    //! Byte offset within blk?????.dat where this block's data is stored
-    unsigned int nDataPos;
+    //! Verification status of this block. See enum BlockStatus
+    unsigned int nStatus;
 
-    //! Byte offset within rev?????.dat where this block's undo data is stored
-    unsigned int nUndoPos;
+    unsigned int nFlags; // ppcoin: block index flags
+    enum {
+        // Lico already defined and it needs to be compatible, cant be 1 needs
+        // to be 128
+        //BLOCK_PROOF_OF_STAKE = (1 << 0), // is proof-of-stake block
+        BLOCK_STAKE_ENTROPY = (1 << 1),  // entropy bit for stake modifier
+        BLOCK_STAKE_MODIFIER = (1 << 2), // regenerated stake modifier
+    };
 
-    //! (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block
-    uint256 nChainWork;
+    //! block header fields used by difficulty and time checks
+    int nVersion;
+    unsigned int nTime;
+    unsigned int nBits;
 
     //! Number of transactions in this block.
     //! Note: in a potential headers-first mode, this number cannot be relied upon
@@ -153,21 +157,29 @@ public:
     //! Change to 64-bit type when necessary; won't happen before 2030
     unsigned int nChainTx;
 
-    //! Verification status of this block. See enum BlockStatus
-    unsigned int nStatus;
+    //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
+    uint32_t nSequenceId;
 
-    unsigned int nFlags; // ppcoin: block index flags
-    enum {
-        // Lico already defined and it needs to be compatible, cant be 1 needs
-        // to be 128
-        //BLOCK_PROOF_OF_STAKE = (1 << 0), // is proof-of-stake block
-        BLOCK_STAKE_ENTROPY = (1 << 1),  // entropy bit for stake modifier
-        BLOCK_STAKE_MODIFIER = (1 << 2), // regenerated stake modifier
-    };
+    uint64_t nStakeModifier; // hash modifier for proof-of-stake
+
+    //! (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block
+    uint256 nChainWork;
+
+    //! Which # file this block is stored in (blk?????.dat)
+    int nFile;
+
+    //! Byte offset within blk?????.dat where this block's data is stored
+    unsigned int nDataPos;
+
+    //! Byte offset within rev?????.dat where this block's undo data is stored
+    unsigned int nUndoPos;
+
+    bool fIsProofOfStake;
+
+    // Cold fields: only read when validating a stake, building a header or for RPC.
 
     // proof-of-stake specific fields
     uint256 GetBlockTrust() const;
-    uint64_t nStakeModifier;             // hash modifier for proof-of-stake
     uint256 nStakeModifierOld;           // Old way to calculate PoS
 
     unsigned int nStakeModifierChecksum; // checksum of index; in-memory only
@@ -177,25 +189,17 @@ public:
     int64_t nMint;
     int64_t nMoneySupply;
 
-    //! block header
-    int nVersion;
+    //! remaining block header fields
     uint256 hashMerkleRoot;
-    unsigned int nTime;
-    unsigned int nBits;
     unsigned int nNonce;
     uint32_t nBirthdayA;
     uint32_t nBirthdayB;
-    bool fIsProofOfStake;
-
-    //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
-    uint32_t nSequenceId;
 
     void SetNull()
     {
         prevoutStake.SetNull();
         phashBlock             = NULL;
         pprev                  = NULL;
-        pnext                  = NULL;
         pskip                  = NULL;
         nHeight                = 0;
         nFile                  = 0;
@@ -242,7 +246,6 @@ public:
         nBirthdayB             = block.nBirthdayB;
         if (nVersion == 2)
             fIsProofOfStake        = block.fIsProofOfStake;
-        bnChainTrust           = uint256();
         nMint                  = 0;
         nMoneySupply           = 0;
         nFlags                 = 0;
@@ -508,7 +511,7 @@ public:
     {
         if (UseLegacyCode(nHeight))
             return strprintf("CBlockIndex(pprev=%s, pnext=%s, nHeight=%d, moneysupply=%d, type=%s, nStakeModifier=%s, version=%d, nTime=%u, nBits=%x, nNonce=%u, nBirthdayA=%u, nBirthdayB=%u, merkle=%s, hashBlock=%s)",
-                pprev ? pprev->GetBlockHash().ToString() : hashPrev.ToString(), pnext ? pnext->GetBlockHash().ToString() : hashNext.ToString(), nHeight, nMoneySupply,
+                pprev ? pprev->GetBlockHash().ToString() : hashPrev.ToString(), hashNext.ToString(), nHeight, nMoneySupply,
                 IsProofOfStake() ? "PoS" : "PoW",
                 nStakeModifierOld.ToString(),
                 nVersion, nTime, nBits, nNonce, nBirthdayA, nBirthdayB,
@@ -517,7 +520,7 @@ public:
         else
 
             return strprintf("CBlockIndex(pprev=%p, pnext=%p, nHeight=%d, moneysupply=%d, type=%s, nStakeModifierOld=%s, nStakeModifier=%x, version=%d, nTime=%u, nBits=%x, nNonce=%u, nBirthdayA=%u, nBirthdayB=%u, merkle=%s, hashBlock=%s)",
-                pprev ? pprev->GetBlockHash().ToString() : hashPrev.ToString(), pnext ? pnext->GetBlockHash().ToString() : hashNext.ToString(), nHeight, nMoneySupply,
+                pprev ? pprev->GetBlockHash().ToString() : hashPrev.ToString(), hashNext.ToString(), nHeight, nMoneySupply,
                 fIsProofOfStake ? "PoS" : "PoW",
                 nStakeModifierOld.ToString(),
                 nStakeModifier,
@@ -527,6 +530,33 @@ public:
     }
 };
 
+/**
+ * Allocator for the entries of mapBlockIndex. Entries are carved out of large
+ * chunks, so entries created together (as when the index is loaded) are
+ * adjacent in memory and don't each pay for a separate heap allocation.
+ * Entries are only released all at once, by Clear().
+ */
+class CBlockIndexArena
+{
+private:
+    static const size_t CHUNK_ENTRIES = 4096;
+
+    std::vector<CBlockIndex*> vChunks;
+    size_t nUsedInLastChunk;
+
+    void* Allocate();
+
+public:
+    CBlockIndexArena() : nUsedInLastChunk(CHUNK_ENTRIES) {}
+    ~CBlockIndexArena() { Clear(); }
+
+    CBlockIndex* Create() { return new (Allocate()) CBlockIndex(); }
+    CBlockIndex* Create(const CBlock& block) { return new (Allocate()) CBlockIndex(block); }
+
+    //! Destroy every entry handed out so far
+    void Clear();
+};
+
 /** An in-memory indexed chain of blocks. */
 class CChain
 {
@@ -187,6 +187,9 @@ vSeeds.push_back(CDNSSeedData("seed1", "puclxktvdiujyqb75bjs4n4cuhvh4eiwoptbsl5n
             }
         };
 
+        // Last checkpoint
+        defaultAssumeValid = uint256S("0xed517719cd2f28babe67259cf12421c5dee60f3f53bbd91d17797b3b37ef2172");
+
         chainTxData = ChainTxData{
         // Data from rpc: getchaintxstats 
         /* nTime    */ 1560981536,
@@ -260,6 +263,9 @@ vSeeds.push_back(CDNSSeedData("seed1", "puclxktvdiujyqb75bjs4n4cuhvh4eiwoptbsl5n
             }
         };
 
+        // Last checkpoint
+        defaultAssumeValid = uint256S("0x1e6f740505ec341d05c6d6f4cf4349d6f00b74118fd7cee107d068fc4c0b98d8");
+
         chainTxData = ChainTxData{
             // Data from rpc: getchaintxstats
             /* nTime    */ 1571691419,
@@ -316,6 +322,8 @@ public:
             }
         };
 
+        defaultAssumeValid = uint256(0);
+
         chainTxData = ChainTxData{
         // Data from rpc: getchaintxstats 20160 e5b7d252d6b2ab66702ddd457d90cc13db34b17e01201db056d91736aa505865
         /* nTime    */ 1454124731,
@@ -134,6 +134,8 @@ public:
     
     const CCheckpointData&    GetCheckpoints() const                   { return checkpointData; }
     const ChainTxData&        GetTxData() const                        { return chainTxData; }
+    /** Default for -assumevalid: scripts in ancestors of this block are not verified */
+    const uint256&            DefaultAssumeValid() const               { return defaultAssumeValid; }
 
 protected:
     CChainParams() {}
@@ -181,6 +183,7 @@ protected:
     
     CCheckpointData            checkpointData;
     ChainTxData                chainTxData;
+    uint256                    defaultAssumeValid;
 
     void MineNewGenesisBlock_Legacy();
 };
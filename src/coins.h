@@ -345,6 +345,21 @@ public:
     }
 };
 
+/** Salted hasher for outpoints, see CCoinsKeyHasher */
+class COutPointHasher
+{
+private:
+    uint256 salt;
+
+public:
+    COutPointHasher();
+
+    size_t operator()(const COutPoint& outpoint) const
+    {
+        return (size_t)outpoint.hash.GetHash(salt) ^ outpoint.n;
+    }
+};
+
 struct CCoinsCacheEntry {
     CCoins coins; // The actual cached data.
     unsigned char flags;
@@ -371,6 +386,7 @@ struct CCoinsStats {
     CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
 };
 
+class CAutoFile;
 
 /** Abstract view on the open txout dataset. */
 class CCoinsView
@@ -393,6 +409,9 @@ public:
     //! Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats& stats) const;
 
+    //! Stream the unspent transaction output set to a snapshot file
+    virtual bool DumpSnapshot(CAutoFile& fileout, uint64_t& nCoins, uint256& hashCommitment) const;
+
     //! As we use CCoinsViews polymorphically, have a virtual destructor
     virtual ~CCoinsView() {}
 };
@@ -412,6 +431,7 @@ public:
     void SetBackend(CCoinsView& viewIn);
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
     bool GetStats(CCoinsStats& stats) const;
+    bool DumpSnapshot(CAutoFile& fileout, uint64_t& nCoins, uint256& hashCommitment) const;
 };
 
 class CCoinsViewCache;
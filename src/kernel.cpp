@@ -121,9 +121,6 @@ void StartStakeModifier_Legacy(CBlockIndex* pindexNew)
         pindexNew->SetStakeModifier(nStakeModifier, true);
         pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
 
-        if (pindexNew->nHeight)
-            pindexNew->pprev->pnext = pindexNew;
-
         // mark as PoS seen
         if (pindexNew->IsProofOfStake())
             setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
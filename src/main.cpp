@@ -10,6 +10,9 @@
 #include "alert.h"
 #include "arith_uint256.h" // Legacy
 #include "base58.h"
+#include "blockencodings.h"
+#include "blockcache.h"
+#include "blockfilecache.h"
 #include "blocksignature.h"
 #include "chainparams.h"
 #include "checkpoints.h"
@@ -56,9 +59,11 @@ using namespace std;
  * Global state
  */
 
-CCriticalSection cs_main;
+CCriticalSection cs_main(true);
 
 BlockMap mapBlockIndex;
+/** Owns the CBlockIndex entries referenced by mapBlockIndex */
+static CBlockIndexArena blockIndexArena;
 map<uint256, uint256> mapProofOfStake;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 map<unsigned int, unsigned int> mapHashedBlocks;
@@ -68,8 +73,11 @@ int64_t nTimeBestReceived = 0;
 std::mutex csBestBlock;
 std::condition_variable cvBlockChange;
 int nScriptCheckThreads = 0;
+int nTxPreValidationThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
+bool fReindexChainState = false;
+bool fMempoolLoaded = false;
 bool fTxIndex = true;
 bool fHavePruned = false;            // Legacy
 bool fPruneMode = false;             // Legacy
@@ -82,6 +90,7 @@ bool fRequireStandard = true;                                 // Legacy
 unsigned int nBytesPerSigOp = DEFAULT_BYTES_PER_SIGOP_LEGACY; // Legacy
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
+uint256 hashAssumeValid;
 bool fVerifyingBlocks = false;
 unsigned int nCoinCacheSize = 5000;
 bool fAlerts = DEFAULT_ALERTS;
@@ -101,11 +110,25 @@ CFeeRate minRelayTxFee = CFeeRate(10000);
 CTxMemPool mempool(::minRelayTxFee);
 
 struct COrphanTx {
-    CTransaction tx;
+    CTransactionRef tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nTxSize;
+    //! Position of the orphan in its peer's COrphanPeer::vOrphans
+    size_t nPeerPos;
+};
+/** Orphan pool usage of one peer */
+struct COrphanPeer {
+    std::vector<uint256> vOrphans;
+    size_t nBytes;
+
+    COrphanPeer() : nBytes(0) {}
 };
-map<uint256, COrphanTx> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+boost::unordered_map<uint256, COrphanTx, CCoinsKeyHasher> mapOrphanTransactions;
+boost::unordered_map<COutPoint, std::vector<uint256>, COutPointHasher> mapOrphanTransactionsByPrev;
+std::map<NodeId, COrphanPeer> mapOrphanPeers;
+size_t nOrphanBytes = 0;
+int64_t nNextOrphanSweep = 0;
 map<uint256, int64_t> mapRejectedBlocks;
 
 
@@ -207,6 +230,7 @@ struct QueuedBlock {
     int64_t nTime;              //! Time of "getdata" request in microseconds.
     int nValidatedQueuedBefore; //! Number of blocks queued with validated headers (globally) at the time this one is requested.
     bool fValidatedHeaders;     //! Whether this block has validated headers at the time of request.
+    boost::shared_ptr<PartiallyDownloadedBlock> partialBlock; //! Optional, set while rebuilding it from a cmpctblock.
 };
 map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -225,6 +249,9 @@ set<int> setDirtyFileInfo;
 /** Number of peers from which we're downloading blocks. */
 int nPeersWithValidatedDownloads = 0;
 
+/** Peers we asked to announce new blocks with a cmpctblock, oldest first. Protected by cs_main. */
+std::list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
 } // namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -273,11 +300,23 @@ struct CNodeState {
     int64_t nStallingSince;
     list<QueuedBlock> vBlocksInFlight;
     int nBlocksInFlight;
+    //! Moving average of the time (in microseconds) this peer takes to deliver a block we requested, or 0.
+    int64_t nAvgBlockTime;
+    //! When this peer last delivered a block we requested (in microseconds).
+    int64_t nLastBlockTime;
     int nBlocksInFlightValidHeaders; // Legacy
     int64_t nDownloadingSince;       // Legacy
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
     bool fPreferHeaders; // Legacy
+    //! Length of current-streak of unconnecting headers announcements
+    int nUnconnectingHeaders;
+    //! Whether this peer wants new blocks announced with a cmpctblock.
+    bool fPreferHeaderAndIDs;
+    //! Whether this peer can serve cmpctblock, getblocktxn and blocktxn messages.
+    bool fProvidesHeaderAndIDs;
+    //! Whether we asked this peer to announce new blocks to us with a cmpctblock.
+    bool fHighBandwidthFrom;
 
     CNodeState()
     {
@@ -291,11 +330,17 @@ struct CNodeState {
         fSyncStarted = false;
         nStallingSince = 0;
         nBlocksInFlight = 0;
+        nAvgBlockTime = 0;
+        nLastBlockTime = 0;
         fPreferredDownload = false;
         //Legacy
         nDownloadingSince = 0;
         nBlocksInFlightValidHeaders = 0;
         fPreferHeaders = false;
+        nUnconnectingHeaders = 0;
+        fPreferHeaderAndIDs = false;
+        fProvidesHeaderAndIDs = false;
+        fHighBandwidthFrom = false;
     }
 };
 
@@ -360,9 +405,11 @@ static void FinalizeNode_Legacy(NodeId nodeid)
     }
 
     BOOST_FOREACH (const QueuedBlock& entry, state->vBlocksInFlight) {
+        nQueuedValidatedHeaders -= entry.fValidatedHeaders;
         mapBlocksInFlight.erase(entry.hash);
     }
     EraseOrphansFor(nodeid);
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
     nPeersWithValidatedDownloads -= (state->nBlocksInFlightValidHeaders != 0);
     assert(nPeersWithValidatedDownloads >= 0);
@@ -385,35 +432,31 @@ static bool FinalizeNode_Fork(NodeId nodeid)
     return true;
 }
 
-// Requires cs_main.
-void MarkBlockAsReceived(const uint256& hash)
-{
-    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
-    if (itInFlight != mapBlocksInFlight.end()) {
-        CNodeState* state = State(itInFlight->second.first);
-        nQueuedValidatedHeaders -= itInFlight->second.second->fValidatedHeaders;
-        state->vBlocksInFlight.erase(itInFlight->second.second);
-        state->nBlocksInFlight--;
-        state->nStallingSince = 0;
-        mapBlocksInFlight.erase(itInFlight);
-    }
-}
-
 // Requires cs_main.
 // Returns a bool indicating whether we requested this block.
-bool MarkBlockAsReceived_Legacy(const uint256& hash)
+// nodeFrom is the peer that delivered it, -1 when the request is dropped for another reason.
+bool MarkBlockAsReceived_Legacy(const uint256& hash, NodeId nodeFrom = -1)
 {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState* state = State(itInFlight->second.first);
-        state->nBlocksInFlightValidHeaders -= itInFlight->second.second->fValidatedHeaders;
-        if (state->nBlocksInFlightValidHeaders == 0 && itInFlight->second.second->fValidatedHeaders) {
+        const QueuedBlock& queuedBlock = *itInFlight->second.second;
+        int64_t nNow = GetTimeMicros();
+        if (itInFlight->second.first == nodeFrom) {
+            // Time since the request, or since the previous delivery if the peer was still busy with that one
+            int64_t nBlockTime = nNow - std::max(queuedBlock.nTime, state->nLastBlockTime);
+            state->nAvgBlockTime = state->nAvgBlockTime == 0 ? nBlockTime : (7 * state->nAvgBlockTime + nBlockTime) / 8;
+            state->nLastBlockTime = nNow;
+        }
+        nQueuedValidatedHeaders -= queuedBlock.fValidatedHeaders;
+        state->nBlocksInFlightValidHeaders -= queuedBlock.fValidatedHeaders;
+        if (state->nBlocksInFlightValidHeaders == 0 && queuedBlock.fValidatedHeaders) {
             // Last validated block on the queue was received.
             nPeersWithValidatedDownloads--;
         }
         if (state->vBlocksInFlight.begin() == itInFlight->second.second) {
             // First block on the queue was received, update the start download time for the next one
-            state->nDownloadingSince = std::max(state->nDownloadingSince, GetTimeMicros());
+            state->nDownloadingSince = std::max(state->nDownloadingSince, nNow);
         }
         state->vBlocksInFlight.erase(itInFlight->second.second);
         state->nBlocksInFlight--;
@@ -424,21 +467,10 @@ bool MarkBlockAsReceived_Legacy(const uint256& hash)
     return false;
 }
 
-
 // Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex = NULL)
+void MarkBlockAsReceived(const uint256& hash, NodeId nodeFrom = -1)
 {
-    CNodeState* state = State(nodeid);
-    assert(state != NULL);
-
-    // Make sure it's not listed somewhere already.
-    MarkBlockAsReceived(hash);
-
-    QueuedBlock newentry = {hash, pindex, GetTimeMicros(), nQueuedValidatedHeaders, pindex != NULL};
-    nQueuedValidatedHeaders += newentry.fValidatedHeaders;
-    list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
-    state->nBlocksInFlight++;
-    mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+    MarkBlockAsReceived_Legacy(hash, nodeFrom);
 }
 
 // Requires cs_main.
@@ -450,7 +482,8 @@ void MarkBlockAsInFlight_Legacy(NodeId nodeid, const uint256& hash, CBlockIndex*
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived_Legacy(hash);
 
-    QueuedBlock newentry = {hash, pindex, pindex != NULL};
+    QueuedBlock newentry = {hash, pindex, GetTimeMicros(), nQueuedValidatedHeaders, pindex != NULL};
+    nQueuedValidatedHeaders += newentry.fValidatedHeaders;
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += newentry.fValidatedHeaders;
@@ -458,12 +491,74 @@ void MarkBlockAsInFlight_Legacy(NodeId nodeid, const uint256& hash, CBlockIndex*
         // We're starting a block download (batch) from this peer.
         state->nDownloadingSince = GetTimeMicros();
     }
-    if (state->nBlocksInFlightValidHeaders == 1 && pindex != NULL) {
+    if (state->nBlocksInFlightValidHeaders == 1 && newentry.fValidatedHeaders) {
         nPeersWithValidatedDownloads++;
     }
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
 }
 
+/**
+ * Number of blocks to keep requested from a peer: enough to keep it busy for
+ * BLOCK_DOWNLOAD_QUEUE_TIME at the pace it delivered blocks so far. Fast peers
+ * get a deep queue, slow ones (e.g. over Tor) only hold a few blocks that the
+ * rest of the download could end up waiting for.
+ */
+// Requires cs_main.
+int GetBlocksInTransitLimit(const CNodeState* state)
+{
+    if (state->nAvgBlockTime == 0)
+        return MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    int64_t nBlocks = BLOCK_DOWNLOAD_QUEUE_TIME * 1000000 / state->nAvgBlockTime;
+    return std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(nBlocks, MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER));
+}
+
+/**
+ * Ask pfrom, which just gave us a new tip, to announce its next blocks with a
+ * cmpctblock. Whitelisted peers are always in that mode, other peers rotate
+ * through MAX_CMPCTBLOCK_HB_PEERS slots and the oldest one is switched back to
+ * announcing with headers or invs.
+ */
+// Requires cs_main.
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(CNode* pfrom)
+{
+    CNodeState* nodestate = State(pfrom->GetId());
+    if (nodestate == NULL || !nodestate->fProvidesHeaderAndIDs)
+        return;
+
+    if (pfrom->fWhitelisted) {
+        if (!nodestate->fHighBandwidthFrom) {
+            pfrom->PushMessage(NetMsgType::SENDCMPCT, true, CMPCTBLOCKS_VERSION);
+            nodestate->fHighBandwidthFrom = true;
+        }
+        return;
+    }
+
+    for (std::list<NodeId>::iterator it = lNodesAnnouncingHeaderAndIDs.begin(); it != lNodesAnnouncingHeaderAndIDs.end(); it++) {
+        if (*it == pfrom->GetId()) {
+            lNodesAnnouncingHeaderAndIDs.splice(lNodesAnnouncingHeaderAndIDs.end(), lNodesAnnouncingHeaderAndIDs, it);
+            return;
+        }
+    }
+
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_CMPCTBLOCK_HB_PEERS) {
+        NodeId nodeEvict = lNodesAnnouncingHeaderAndIDs.front();
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+        CNodeState* stateEvict = State(nodeEvict);
+        if (stateEvict != NULL)
+            stateEvict->fHighBandwidthFrom = false;
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (pnode->GetId() == nodeEvict) {
+                pnode->PushMessage(NetMsgType::SENDCMPCT, false, CMPCTBLOCKS_VERSION);
+                break;
+            }
+        }
+    }
+    pfrom->PushMessage(NetMsgType::SENDCMPCT, true, CMPCTBLOCKS_VERSION);
+    nodestate->fHighBandwidthFrom = true;
+    lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+}
+
 /** Check whether the last unknown block a peer advertized is not yet known. */
 void ProcessBlockAvailability(NodeId nodeid)
 {
@@ -618,6 +713,8 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats)
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.nBlocksInTransitLimit = GetBlocksInTransitLimit(state);
+    stats.nAvgBlockTime = state->nAvgBlockTime;
     return true;
 }
 
@@ -678,65 +775,105 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
     // large transaction with a missing parent then we assume
     // it will rebroadcast it later, after the parent transaction(s)
     // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
     unsigned int sz = tx.GetSerializeSize(SER_NETWORK, GetCurrentTransactionVersion());
-    if (sz > 5000) {
+    if (sz > MAX_ORPHAN_TX_BYTES) {
         LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
+    COrphanPeer& orphanPeer = mapOrphanPeers[peer];
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = MakeTransactionRef(tx);
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nTxSize = sz;
+    orphan.nPeerPos = orphanPeer.vOrphans.size();
+    orphanPeer.vOrphans.push_back(hash);
+    orphanPeer.nBytes += sz;
+    nOrphanBytes += sz;
     BOOST_FOREACH (const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+        mapOrphanTransactionsByPrev[txin.prevout].push_back(hash);
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-        mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u outsz %u bytes %u)\n", hash.ToString(),
+        mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size(), nOrphanBytes);
     return true;
 }
 
 void static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
-    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
+    boost::unordered_map<uint256, COrphanTx, CCoinsKeyHasher>::iterator it = mapOrphanTransactions.find(hash);
     if (it == mapOrphanTransactions.end())
         return;
-    BOOST_FOREACH (const CTxIn& txin, it->second.tx.vin) {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
+    const COrphanTx& orphan = it->second;
+    BOOST_FOREACH (const CTxIn& txin, orphan.tx->vin) {
+        boost::unordered_map<COutPoint, std::vector<uint256>, COutPointHasher>::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
         if (itPrev == mapOrphanTransactionsByPrev.end())
             continue;
-        itPrev->second.erase(hash);
-        if (itPrev->second.empty())
+        std::vector<uint256>& vSpenders = itPrev->second;
+        vSpenders.erase(std::remove(vSpenders.begin(), vSpenders.end(), hash), vSpenders.end());
+        if (vSpenders.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+
+    // Swap the orphan out of its peer's list
+    std::map<NodeId, COrphanPeer>::iterator itPeer = mapOrphanPeers.find(orphan.fromPeer);
+    assert(itPeer != mapOrphanPeers.end());
+    COrphanPeer& orphanPeer = itPeer->second;
+    uint256 hashLast = orphanPeer.vOrphans.back();
+    mapOrphanTransactions[hashLast].nPeerPos = orphan.nPeerPos;
+    orphanPeer.vOrphans[orphan.nPeerPos] = hashLast;
+    orphanPeer.vOrphans.pop_back();
+    orphanPeer.nBytes -= orphan.nTxSize;
+    nOrphanBytes -= orphan.nTxSize;
+    if (orphanPeer.vOrphans.empty())
+        mapOrphanPeers.erase(itPeer);
+
     mapOrphanTransactions.erase(it);
 }
 
 void EraseOrphansFor(NodeId peer)
 {
-    int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end()) {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer) {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
-            ++nErased;
-        }
-    }
-    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
+    std::map<NodeId, COrphanPeer>::iterator itPeer = mapOrphanPeers.find(peer);
+    if (itPeer == mapOrphanPeers.end())
+        return;
+    // Copy, EraseOrphanTx drops the peer's entry along with its last orphan
+    std::vector<uint256> vOrphans = itPeer->second.vOrphans;
+    BOOST_FOREACH (const uint256& hash, vOrphans)
+        EraseOrphanTx(hash);
+    LogPrint("mempool", "Erased %d orphan tx from peer %d\n", vOrphans.size(), peer);
 }
 
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxBytes) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans) {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+
+    int64_t nNow = GetTime();
+    if (nNextOrphanSweep <= nNow) {
+        // Sweep out expired orphan pool entries
+        std::vector<uint256> vExpired;
+        for (boost::unordered_map<uint256, COrphanTx, CCoinsKeyHasher>::const_iterator it = mapOrphanTransactions.begin(); it != mapOrphanTransactions.end(); ++it) {
+            if (it->second.nTimeExpire <= nNow)
+                vExpired.push_back(it->first);
+        }
+        BOOST_FOREACH (const uint256& hash, vExpired)
+            EraseOrphanTx(hash);
+        nEvicted += vExpired.size();
+        nNextOrphanSweep = nNow + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (!vExpired.empty())
+            LogPrint("mempool", "Erased %d expired orphan tx\n", vExpired.size());
+    }
+
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanBytes > nMaxBytes) {
+        // Evict a random orphan of the peer using the most orphan pool space,
+        // so one peer flooding orphans only pushes out its own.
+        std::map<NodeId, COrphanPeer>::const_iterator itPeer = mapOrphanPeers.begin();
+        for (std::map<NodeId, COrphanPeer>::const_iterator it = itPeer; it != mapOrphanPeers.end(); ++it) {
+            if (it->second.nBytes > itPeer->second.nBytes)
+                itPeer = it;
+        }
+        const std::vector<uint256>& vOrphans = itPeer->second.vOrphans;
+        EraseOrphanTx(vOrphans[GetRand(vOrphans.size())]);
         ++nEvicted;
     }
     return nEvicted;
@@ -1297,7 +1434,7 @@ std::string FormatStateMessage_Legacy(const CValidationState& state)
         state.GetRejectCode());
 }
 
-bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fOverrideMempoolLimit, bool fRejectAbsurdFee, std::vector<uint256>& vHashTxnToUncache, bool ignoreFees, bool isLoadingTx)
+bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fOverrideMempoolLimit, bool fRejectAbsurdFee, std::vector<uint256>& vHashTxnToUncache, bool ignoreFees, bool isLoadingTx, int64_t nAcceptTime)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1461,7 +1598,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
 
         unsigned int nSigOps = GetLegacySigOpCount(tx);
         nSigOps += GetP2SHSigOpCount(tx, view);
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOps, lp);
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime ? nAcceptTime : GetTime(), dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOps, lp);
         unsigned int nSize = entry.GetTxSize();
 
         unsigned int nMaxSigOps = MAX_TX_SIGOPS_CURRENT;
@@ -1630,7 +1767,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
                     FormatMoney(nModifiedFees - nConflictingFees),
                     (int)nSize - (int)nConflictingSize);
             }
-            pool.RemoveStaged(allConflicting);
+            pool.RemoveStaged(allConflicting, false, MEMPOOL_REMOVAL_REPLACED);
         }
 
         // Check against previous transactions
@@ -1691,10 +1828,10 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
     return true;
 }
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fOverrideMempoolLimit, bool fRejectAbsurdFee, bool ignoreFees, bool isLoadingTx)
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fOverrideMempoolLimit, bool fRejectAbsurdFee, bool ignoreFees, bool isLoadingTx, int64_t nAcceptTime)
 {
     std::vector<uint256> vHashTxToUncache;
-    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fOverrideMempoolLimit, fRejectAbsurdFee, vHashTxToUncache, ignoreFees, isLoadingTx);
+    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fOverrideMempoolLimit, fRejectAbsurdFee, vHashTxToUncache, ignoreFees, isLoadingTx, nAcceptTime);
     if (!res) {
         BOOST_FOREACH (const uint256& hashTx, vHashTxToUncache)
             pcoinsTip->Uncache(hashTx);
@@ -1900,14 +2037,21 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
         if (fTxIndex) {
             CDiskTxPos postx;
             if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-                if (file.IsNull())
-                    return error("%s: OpenBlockFile failed", __func__);
                 CBlockHeader header;
+                CBlockFileReader mapped(SER_DISK, CLIENT_VERSION);
                 try {
-                    file >> header;
-                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                    file >> txOut;
+                    if (blockFileCache.Open(postx, "blk", 0, mapped)) {
+                        mapped >> header;
+                        mapped.ignore(postx.nTxOffset);
+                        mapped >> txOut;
+                    } else {
+                        CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+                        if (file.IsNull())
+                            return error("%s: OpenBlockFile failed", __func__);
+                        file >> header;
+                        fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
+                        file >> txOut;
+                    }
                 } catch (std::exception& e) {
                     return error("%s : Deserialize or I/O error - %s", __func__, e.what());
                 }
@@ -1977,24 +2121,27 @@ bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos)
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, bool fCheckPOW)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk : OpenBlockFile failed");
-
-    // Read block
+    // Read block, straight from the mapped file when possible
+    CBlockFileReader mapped(SER_DISK, CLIENT_VERSION);
     try {
-        filein >> block;
+        if (blockFileCache.Open(pos, "blk", 0, mapped)) {
+            mapped >> block;
+        } else {
+            CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("ReadBlockFromDisk : OpenBlockFile failed");
+            filein >> block;
+        }
     } catch (std::exception& e) {
         return error("%s : Deserialize or I/O error - %s", __func__, e.what());
     }
 
     // Check the header
-    if (block.IsProofOfWork()) {
+    if (fCheckPOW && block.IsProofOfWork()) {
         if (UseLegacyCode(block)) {
             if (!CheckProofOfWork_Legacy(block.GetHash(), block.nBits))
                 return error("ReadBlockFromDisk : Errors in block header");
@@ -2009,7 +2156,9 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
 {
-    if (!ReadBlockFromDisk(block, pindex->GetBlockPos()))
+    // While rebuilding the chainstate the index entries have already passed header validation,
+    // so matching the index hash below is enough and the proof of work is not recomputed.
+    if (!ReadBlockFromDisk(block, pindex->GetBlockPos(), !fReindexChainState))
         return false;
     if (block.GetHash() != pindex->GetBlockHash()) {
         if (fDebug) {
@@ -2021,6 +2170,20 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+bool ReadBlockFromDisk(boost::shared_ptr<const CBlock>& pblock, const CBlockIndex* pindex)
+{
+    pblock = blockCache.Get(pindex->GetBlockHash());
+    if (pblock)
+        return true;
+
+    boost::shared_ptr<CBlock> pblockRead(new CBlock());
+    if (!ReadBlockFromDisk(*pblockRead, pindex))
+        return false;
+    pblock = pblockRead;
+    blockCache.Insert(pindex->GetBlockHash(), pblock);
+    return true;
+}
+
 double ConvertBitsToDouble(unsigned int nBits)
 {
     int nShift = (nBits >> 24) & 0xff;
@@ -2527,16 +2690,20 @@ static bool ApplyTxInUndo_Legacy(const CTxInUndo& undo, CCoinsViewCache& view, c
 
 bool UndoReadFromDisk_Legacy(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
 {
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("%s: OpenBlockFile failed", __func__);
-
-    // Read block
+    // Read undo data and its checksum, straight from the mapped file when possible
     uint256 hashChecksum;
+    CBlockFileReader mapped(SER_DISK, CLIENT_VERSION);
     try {
-        filein >> blockundo;
-        filein >> hashChecksum;
+        if (blockFileCache.Open(pos, "rev", sizeof(hashChecksum), mapped)) {
+            mapped >> blockundo;
+            mapped >> hashChecksum;
+        } else {
+            CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("%s: OpenBlockFile failed", __func__);
+            filein >> blockundo;
+            filein >> hashChecksum;
+        }
     } catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s", __func__, e.what());
     }
@@ -2756,13 +2923,35 @@ static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
+/**
+ * Whether the scripts of pindex can be skipped under -assumevalid: the block must
+ * be an ancestor of the assumed-valid block, which in turn must be part of our
+ * best header chain. Everything but script and signature evaluation is still
+ * checked for such blocks.
+ */
+static bool IsAssumedValid(const CBlockIndex* pindex)
+{
+    if (hashAssumeValid == 0 || pindexBestHeader == NULL || !pindex->phashBlock)
+        return false;
+
+    BlockMap::const_iterator it = mapBlockIndex.find(hashAssumeValid);
+    if (it == mapBlockIndex.end())
+        return false;
+
+    CBlockIndex* pindexAssumeValid = it->second;
+    if (pindexAssumeValid->nHeight < pindex->nHeight)
+        return false;
+    return pindexAssumeValid->GetAncestor(pindex->nHeight) == pindex &&
+           pindexBestHeader->GetAncestor(pindexAssumeValid->nHeight) == pindexAssumeValid;
+}
+
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck, bool fAlreadyChecked)
 {
     if (UseLegacyCode(block))
         return ConnectBlock_Legacy(block, state, pindex, view, fJustCheck);
     AssertLockHeld(cs_main);
     // Check it again in case a previous version let a bad block in
-    if (!fAlreadyChecked && !CheckBlock(block, state, !fJustCheck, !fJustCheck))
+    if (!fAlreadyChecked && !CheckBlock(block, state, !fJustCheck && !fReindexChainState, !fJustCheck))
         return false;
 
     // verify that the view's current state corresponds to the previous block
@@ -2783,7 +2972,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         return state.DoS(100, error("ConnectBlock() : PoW period ended"),
             REJECT_INVALID, "PoW-ended");
 
-    bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
+    bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate() && !IsAssumedValid(pindex);
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
@@ -3017,7 +3206,7 @@ bool ConnectBlock_Legacy(const CBlock& block, CValidationState& state, CBlockInd
             REJECT_INVALID, "PoW-ended");
 
     // Check it again in case a previous version let a bad block in
-    if (!CheckBlock_Legacy(block, state, !fJustCheck, !fJustCheck))
+    if (!CheckBlock_Legacy(block, state, !fJustCheck && !fReindexChainState, !fJustCheck))
         return false;
 
     // Special case for the genesis block, skipping connection of its transactions
@@ -3065,6 +3254,8 @@ bool ConnectBlock_Legacy(const CBlock& block, CValidationState& state, CBlockInd
             fScriptChecks = false;
         }
     }
+    if (fScriptChecks && IsAssumedValid(pindex))
+        fScriptChecks = false;
 
     int64_t nTime1 = GetTimeMicros();
     nTimeCheck += nTime1 - nTimeStart;
@@ -3428,6 +3619,7 @@ void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
 {
     for (set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
+        blockFileCache.Erase(*it);
         boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
         boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
         if (fDebug)
@@ -3579,7 +3771,7 @@ bool static DisconnectTip(CValidationState& state, bool isLoadingTx = false)
         list<CTransaction> removed;
         CValidationState stateDummy;
         if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, true, true, false, isLoadingTx)) {
-            mempool.remove(tx, removed, true);
+            mempool.remove(tx, removed, true, MEMPOOL_REMOVAL_REORG);
         } else if (mempool.exists(tx.GetHash())) {
             vHashUpdate.push_back(tx.GetHash());
         }
@@ -3616,11 +3808,11 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, const CB
     assert(pindexNew->pprev == chainActive.Tip());
     // Read block from disk.
     int64_t nTime1 = GetTimeMicros();
-    CBlock block;
+    boost::shared_ptr<const CBlock> pblockShared;
     if (!pblock) {
-        if (!ReadBlockFromDisk(block, pindexNew))
+        if (!ReadBlockFromDisk(pblockShared, pindexNew))
             return AbortNode(state, "Failed to read block");
-        pblock = &block;
+        pblock = pblockShared.get();
     }
     // Apply the block atomically to the chain state.
     int64_t nTime2 = GetTimeMicros();
@@ -3636,6 +3828,9 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, const CB
                 InvalidBlockFound(pindexNew, state);
             return error("ConnectTip(): ConnectBlock %s failed", pindexNew->GetBlockHash().ToString());
         }
+        // Peers and RPC ask for a new tip right away, keep it deserialized
+        if (!pblockShared)
+            blockCache.Insert(pindexNew->GetBlockHash(), boost::shared_ptr<const CBlock>(new CBlock(*pblock)));
         mapBlockSource.erase(pindexNew->GetBlockHash());
         nTime3 = GetTimeMicros();
         nTimeConnectTotal += nTime3 - nTime2;
@@ -4073,8 +4268,7 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = blockIndexArena.Create(block);
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
@@ -4087,12 +4281,6 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
         pindexNew->BuildSkip();
         if (!UseLegacyCode(block)) {
-            //update previous block pointer
-            pindexNew->pprev->pnext = pindexNew;
-
-            // ppcoin: compute chain trust score
-            pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
-
             // ppcoin: compute stake entropy bit for stake modifier
             if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()) && fDebug)
                 LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
@@ -4125,11 +4313,6 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
     pindexNew->RaiseValidity(BLOCK_VALID_TREE);
     if (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindexNew->nChainWork)
         pindexBestHeader = pindexNew;
-    if (!UseLegacyCode(block)) {
-        //update previous block pointer
-        if (pindexNew->nHeight)
-            pindexNew->pprev->pnext = pindexNew;
-    }
     setDirtyBlockIndex.insert(pindexNew);
 
     return pindexNew;
@@ -4477,8 +4660,6 @@ bool CheckBlock_Legacy(const CBlock& block, CValidationState& state, bool fCheck
     if (!CheckBlockHeader_Legacy(block, state, block.IsProofOfWork() && fCheckPOW))
         return false;
 
-    CBlockIndex* pindexPrev = chainActive.Tip();
-
     // Check the merkle root.
     if (fCheckMerkleRoot) {
         bool mutated;
@@ -4539,19 +4720,6 @@ bool CheckBlock_Legacy(const CBlock& block, CValidationState& state, bool fCheck
     if (!CheckBlockSignature_Legacy(block, block.GetHash()))
         return state.DoS(100, error("CheckBlock(): bad proof-of-stake block signature"), REJECT_INVALID, "bad-block-signature");
 
-    // ----------- masternode payments / budgets -----------
-
-
-    if (pindexPrev != NULL) {
-        int nHeight = 0;
-        if (pindexPrev->GetBlockHash() == block.hashPrevBlock) {
-            nHeight = pindexPrev->nHeight + 1;
-        } else { //out of order
-            BlockMap::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
-            if (mi != mapBlockIndex.end() && (*mi).second)
-                nHeight = (*mi).second->nHeight + 1;
-        }
-    }
     // Check transactions
     BOOST_FOREACH (const CTransaction& tx, block.vtx) {
         if (!CheckTransaction(tx, state))
@@ -5079,14 +5247,14 @@ void CBlockIndex::BuildSkip()
         pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
 
-bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp)
+bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp, bool fAlreadyChecked)
 {
     // Preliminary checks
     int64_t nStartTime = GetTimeMillis();
     // we will be processing the next tip block
-    bool checked = CheckBlock(*pblock, state);
+    bool checked = fAlreadyChecked || CheckBlock(*pblock, state);
 
-    if (!CheckBlockSignature(*pblock))
+    if (!fAlreadyChecked && !CheckBlockSignature(*pblock))
         return error("ProcessNewBlock() : bad proof-of-stake block signature");
 
     if (pblock->GetHash() != Params().HashGenesisBlock() && pfrom != NULL) {
@@ -5101,7 +5269,7 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
     {
         LOCK(cs_main); // Replaces the former TRY_LOCK loop because busy waiting wastes too much resources
 
-        MarkBlockAsReceived(pblock->GetHash());
+        MarkBlockAsReceived(pblock->GetHash(), pfrom ? pfrom->GetId() : -1);
         if (!checked) {
             return error("%s : CheckBlock FAILED for block %s", __func__, pblock->GetHash().GetHex());
         }
@@ -5167,7 +5335,7 @@ bool ProcessNewBlock_Legacy(CValidationState& state, const CChainParams& chainpa
 
     {
         LOCK(cs_main);
-        bool fRequested = MarkBlockAsReceived_Legacy(pblock->GetHash());
+        bool fRequested = MarkBlockAsReceived_Legacy(pblock->GetHash(), pfrom ? pfrom->GetId() : -1);
         fRequested |= fForceProcessing;
 
         // Store to disk
@@ -5331,9 +5499,7 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockIndexArena.Create();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
 
     pindexNew->phashBlock = &((*mi).first);
@@ -5341,9 +5507,206 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
+namespace {
+
+//! Version of the block index snapshot written at shutdown
+const int BLOCK_INDEX_SNAPSHOT_VERSION = 1;
+//! Name of the block tree database entry holding the nonce of the valid block index snapshot
+const char* const BLOCK_INDEX_SNAPSHOT_MARKER = "indexsnapshot";
+
+/**
+ * One block index entry of the block index snapshot (blockindex.dat). Records
+ * are fixed width and stored in host layout right after the header, so the
+ * file can be read (or mapped) in one go without any per-entry decoding or
+ * block hashing. Field order avoids padding.
+ */
+struct CBlockIndexSnapshotRecord {
+    uint256 hash;
+    uint256 hashPrev;
+    uint256 hashMerkleRoot;
+    uint256 nStakeModifierOld;
+    uint256 hashPrevoutStake;
+    int64_t nMint;
+    int64_t nMoneySupply;
+    uint64_t nStakeModifier;
+    int32_t nHeight;
+    int32_t nFile;
+    int32_t nVersion;
+    uint32_t nDataPos;
+    uint32_t nUndoPos;
+    uint32_t nTime;
+    uint32_t nBits;
+    uint32_t nNonce;
+    uint32_t nBirthdayA;
+    uint32_t nBirthdayB;
+    uint32_t nStatus;
+    uint32_t nTx;
+    uint32_t nFlags;
+    uint32_t nPrevoutStakeN;
+    uint32_t nStakeTime;
+    uint32_t nReserved;
+};
+
+boost::filesystem::path GetBlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blocks" / "blockindex.dat";
+}
+
+/**
+ * Fill mapBlockIndex from the snapshot written by WriteBlockIndexSnapshot at the
+ * last clean shutdown. The snapshot is only trusted when the block tree still
+ * carries its nonce; the nonce is cleared before anything else happens, so
+ * later writes to the block index always invalidate the file. Returns false,
+ * without touching mapBlockIndex, if the snapshot is missing or unusable.
+ */
+bool LoadBlockIndexSnapshot()
+{
+    int nMarker = 0;
+    if (!pblocktree->ReadInt(BLOCK_INDEX_SNAPSHOT_MARKER, nMarker) || nMarker == 0)
+        return false;
+    if (!pblocktree->WriteInt(BLOCK_INDEX_SNAPSHOT_MARKER, 0))
+        return false;
+
+    CAutoFile filein(fopen(GetBlockIndexSnapshotPath().string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return false;
+
+    std::vector<CBlockIndexSnapshotRecord> vRecords;
+    try {
+        int nVersion, nMarkerFile;
+        uint32_t nRecordSize;
+        uint64_t nRecords;
+        filein >> nVersion >> nRecordSize >> nMarkerFile >> nRecords;
+        if (nVersion != BLOCK_INDEX_SNAPSHOT_VERSION || nRecordSize != sizeof(CBlockIndexSnapshotRecord) || nMarkerFile != nMarker) {
+            LogPrintf("%s: ignoring stale or incompatible block index snapshot\n", __func__);
+            return false;
+        }
+        long nHeaderSize = ftell(filein.Get());
+        if (nHeaderSize < 0 || fseek(filein.Get(), 0, SEEK_END))
+            return error("%s : fseek failed", __func__);
+        long nFileSize = ftell(filein.Get());
+        if (nFileSize < nHeaderSize || (uint64_t)(nFileSize - nHeaderSize) != nRecords * sizeof(CBlockIndexSnapshotRecord))
+            return error("%s : block index snapshot has the wrong size", __func__);
+        if (fseek(filein.Get(), nHeaderSize, SEEK_SET))
+            return error("%s : fseek failed", __func__);
+        vRecords.resize(nRecords);
+        if (nRecords && fread(&vRecords[0], sizeof(CBlockIndexSnapshotRecord), nRecords, filein.Get()) != nRecords)
+            return error("%s : failed to read block index snapshot", __func__);
+    } catch (const std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+
+    BOOST_FOREACH (const CBlockIndexSnapshotRecord& rec, vRecords) {
+        CBlockIndex* pindexNew    = InsertBlockIndex(rec.hash);
+        pindexNew->pprev          = InsertBlockIndex(rec.hashPrev);
+        pindexNew->nHeight        = rec.nHeight;
+        pindexNew->nFile          = rec.nFile;
+        pindexNew->nDataPos       = rec.nDataPos;
+        pindexNew->nUndoPos       = rec.nUndoPos;
+        pindexNew->nVersion       = rec.nVersion;
+        pindexNew->hashMerkleRoot = rec.hashMerkleRoot;
+        pindexNew->nTime          = rec.nTime;
+        pindexNew->nBits          = rec.nBits;
+        pindexNew->nNonce         = rec.nNonce;
+        pindexNew->nBirthdayA     = rec.nBirthdayA;
+        pindexNew->nBirthdayB     = rec.nBirthdayB;
+        pindexNew->nStatus        = rec.nStatus;
+        pindexNew->nTx            = rec.nTx;
+
+        //Proof Of Stake
+        pindexNew->nMint             = rec.nMint;
+        pindexNew->nMoneySupply      = rec.nMoneySupply;
+        pindexNew->nFlags            = rec.nFlags;
+        pindexNew->nStakeModifier    = rec.nStakeModifier;
+        pindexNew->nStakeModifierOld = rec.nStakeModifierOld;
+        pindexNew->prevoutStake      = COutPoint(rec.hashPrevoutStake, rec.nPrevoutStakeN);
+        pindexNew->nStakeTime        = rec.nStakeTime;
+
+        // ppcoin: build setStakeSeen
+        if (!UseLegacyCode(pindexNew->nHeight) && pindexNew->IsProofOfStake())
+            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+    }
+
+    LogPrintf("%s: loaded %u block index entries from snapshot\n", __func__, vRecords.size());
+    return true;
+}
+
+} // anon namespace
+
+bool WriteBlockIndexSnapshot()
+{
+    AssertLockHeld(cs_main);
+
+    if (mapBlockIndex.empty() || !setDirtyBlockIndex.empty())
+        return false;
+
+    boost::filesystem::path pathSnapshot = GetBlockIndexSnapshotPath();
+    boost::filesystem::path pathTmp = pathSnapshot.string() + ".new";
+
+    CAutoFile fileout(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("%s : failed to open %s", __func__, pathTmp.string());
+
+    int nMarker = 1 + GetRandInt(std::numeric_limits<int>::max() - 1);
+    try {
+        fileout << BLOCK_INDEX_SNAPSHOT_VERSION << (uint32_t)sizeof(CBlockIndexSnapshotRecord) << nMarker << (uint64_t)mapBlockIndex.size();
+
+        std::vector<CBlockIndexSnapshotRecord> vRecords;
+        vRecords.reserve(4096);
+        for (BlockMap::const_iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it) {
+            const CBlockIndex* pindex = it->second;
+            vRecords.push_back(CBlockIndexSnapshotRecord());
+            CBlockIndexSnapshotRecord& rec = vRecords.back();
+            rec.hash = it->first;
+            rec.hashPrev = pindex->pprev ? pindex->pprev->GetBlockHash() : uint256();
+            rec.hashMerkleRoot = pindex->hashMerkleRoot;
+            rec.nStakeModifierOld = pindex->nStakeModifierOld;
+            rec.hashPrevoutStake = pindex->prevoutStake.hash;
+            rec.nMint = pindex->nMint;
+            rec.nMoneySupply = pindex->nMoneySupply;
+            rec.nStakeModifier = pindex->nStakeModifier;
+            rec.nHeight = pindex->nHeight;
+            rec.nFile = pindex->nFile;
+            rec.nVersion = pindex->nVersion;
+            rec.nDataPos = pindex->nDataPos;
+            rec.nUndoPos = pindex->nUndoPos;
+            rec.nTime = pindex->nTime;
+            rec.nBits = pindex->nBits;
+            rec.nNonce = pindex->nNonce;
+            rec.nBirthdayA = pindex->nBirthdayA;
+            rec.nBirthdayB = pindex->nBirthdayB;
+            rec.nStatus = pindex->nStatus;
+            rec.nTx = pindex->nTx;
+            rec.nFlags = pindex->nFlags;
+            rec.nPrevoutStakeN = pindex->prevoutStake.n;
+            rec.nStakeTime = pindex->nStakeTime;
+            rec.nReserved = 0;
+
+            if (vRecords.size() == vRecords.capacity()) {
+                fileout.write((const char*)&vRecords[0], vRecords.size() * sizeof(CBlockIndexSnapshotRecord));
+                vRecords.clear();
+            }
+        }
+        if (!vRecords.empty())
+            fileout.write((const char*)&vRecords[0], vRecords.size() * sizeof(CBlockIndexSnapshotRecord));
+    } catch (const std::exception& e) {
+        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+    }
+
+    FileCommit(fileout.Get());
+    fileout.fclose();
+    if (!RenameOver(pathTmp, pathSnapshot))
+        return error("%s : rename failed", __func__);
+    if (!pblocktree->WriteInt(BLOCK_INDEX_SNAPSHOT_MARKER, nMarker))
+        return error("%s : failed to write snapshot marker", __func__);
+
+    LogPrintf("%s: wrote %u block index entries\n", __func__, mapBlockIndex.size());
+    return true;
+}
+
 bool static LoadBlockIndexDB()
 {
-    if (!pblocktree->LoadBlockIndexGuts())
+    if (!LoadBlockIndexSnapshot() && !pblocktree->LoadBlockIndexGuts())
         return false;
 
     boost::this_thread::interruption_point();
@@ -5359,7 +5722,7 @@ bool static LoadBlockIndexDB()
     BOOST_FOREACH (const PAIRTYPE(int, CBlockIndex*) & item, vSortedByHeight) {
         CBlockIndex* pindex = item.second;
         pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
-        bool check = UseLegacyCode(pindex->nHeight) ? pindex->nTx > 0 : pindex->nStatus & BLOCK_HAVE_DATA;
+        bool check = UseLegacyCode(pindex->nHeight) ? pindex->nTx > 0 : pindex->nStatus & (BLOCK_HAVE_DATA | BLOCK_HAVE_SNAPSHOT);
         if (check) {
             if (pindex->pprev) {
                 if (pindex->pprev->nChainTx) {
@@ -5500,6 +5863,9 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
         
         if (pindex->nHeight < chainActive.Height() - nCheckDepth)
             break;
+        // Blocks below a loaded UTXO snapshot may not have been imported yet
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+            break;
         CBlock block;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex))
@@ -5565,6 +5931,8 @@ void UnloadBlockIndex_Legacy()
     mempool.clear();
     mapOrphanTransactions.clear();
     mapOrphanTransactionsByPrev.clear();
+    mapOrphanPeers.clear();
+    nOrphanBytes = 0;
     nSyncStarted = 0;
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
@@ -5582,10 +5950,8 @@ void UnloadBlockIndex_Legacy()
         warningcache[b].clear();
     }
 
-    BOOST_FOREACH (BlockMap::value_type& entry, mapBlockIndex) {
-        delete entry.second;
-    }
     mapBlockIndex.clear();
+    blockIndexArena.Clear();
     fHavePruned = false;
 }
 
@@ -5619,6 +5985,11 @@ bool InitBlockIndex()
     if (chainActive.Genesis() != NULL)
         return true;
 
+    // With -reindex-chainstate the block index is kept and only the chainstate is empty;
+    // the blocks (genesis included) are reconnected from disk by ThreadImport.
+    if (fReindexChainState && mapBlockIndex.count(Params().HashGenesisBlock()))
+        return true;
+
     // Use the provided setting for -txindex in the new database
     fTxIndex = GetBoolArg("-txindex", true);
     pblocktree->WriteFlag("txindex", fTxIndex);
@@ -5654,121 +6025,557 @@ bool InitBlockIndex()
     return true;
 }
 
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
+bool DumpUTXOSnapshot(CAutoFile& fileout, CCoinsSnapshotMetadata& metadata)
 {
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
-    int64_t nStart = GetTimeMillis();
-    const CChainParams& chainparams = Params();
+    AssertLockHeld(cs_main);
+
+    CBlockIndex* pindexBase = chainActive.Tip();
+    if (pindexBase == NULL || pcoinsTip->GetBestBlock() != pindexBase->GetBlockHash())
+        return error("%s : chainstate is not flushed at the active tip", __func__);
+
+    metadata.SetNull();
+    memcpy(metadata.pchMessageStart, Params().MessageStart(), sizeof(metadata.pchMessageStart));
+    metadata.hashBlock = pindexBase->GetBlockHash();
+    metadata.nHeight = pindexBase->nHeight;
+    metadata.nBlockIndexEntries = pindexBase->nHeight + 1;
 
-    int nLoaded = 0;
     try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SIZE, MAX_BLOCK_SIZE + 8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
+        // Placeholder, rewritten below once the coin count and commitment are known
+        fileout << metadata;
+
+        // File positions are meaningless on the importing node, so strip them
+        for (int nHeight = 0; nHeight <= pindexBase->nHeight; nHeight++) {
             boost::this_thread::interruption_point();
+            CDiskBlockIndex diskindex(chainActive[nHeight]);
+            diskindex.nStatus &= ~(BLOCK_HAVE_MASK | BLOCK_HAVE_SNAPSHOT);
+            fileout << diskindex;
+        }
 
-            blkdat.SetPos(nRewind);
-            nRewind++;         // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos() + 1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
-                break;
-            }
-            try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
+        if (!pcoinsTip->DumpSnapshot(fileout, metadata.nCoins, metadata.hashCommitment))
+            return error("%s : failed to write coins", __func__);
 
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
-                }
+        if (fseek(fileout.Get(), 0, SEEK_SET))
+            return error("%s : fseek failed", __func__);
+        fileout << metadata;
+    } catch (std::exception& e) {
+        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+    }
 
-                // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
-                    CValidationState state;
-                    if (UseLegacyCode(block)) {
-                        if (ProcessNewBlock_Legacy(state, chainparams, NULL, &block, true, dbp))
-                            nLoaded++;
-                    } else {
-                        if (ProcessNewBlock(state, NULL, &block, dbp))
-                            nLoaded++;
-                    }
-                    if (state.IsError())
-                        break;
-                } else if (hash != Params().HashGenesisBlock() && mapBlockIndex[hash]->nHeight % 1000 == 0 && fDebug)
-                    LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+    LogPrintf("%s: wrote %u coins at height %d (%s), commitment %s\n", __func__,
+        metadata.nCoins, metadata.nHeight, metadata.hashBlock.ToString(), metadata.hashCommitment.ToString());
+    return true;
+}
 
-                // Recursively process earlier encountered successors of this block
-                deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second)) {
-                            if (fDebug)
-                                LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(), head.ToString());
-                            
-                            CValidationState dummy;
-                            if (UseLegacyCode(block)) {
-                                if (ProcessNewBlock_Legacy(dummy, chainparams, NULL, &block, true, &it->second))
-                                    nLoaded++;
-                            } else if (ProcessNewBlock(dummy, NULL, &block, &it->second))
-                                nLoaded++;
-                            queue.push_back(block.GetHash());
-                        }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
-                    }
-                }
-            } catch (std::exception& e) {
-                LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
-            }
-        }
-    } catch (std::runtime_error& e) {
-        AbortNode(std::string("System error: ") + e.what());
+bool LoadUTXOSnapshot(CAutoFile& filein, CCoinsViewDB* pcoinsview, CCoinsSnapshotMetadata& metadata)
+{
+    LOCK(cs_main);
+
+    if (pcoinsview->GetBestBlock() != 0)
+        return error("%s : chainstate is not empty", __func__);
+
+    try {
+        filein >> metadata;
+    } catch (std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
     }
-    if (fDebug)
-        LogPrintf("LoadExternalBlockFile Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
-    
-    return nLoaded > 0;
+    if (memcmp(metadata.pchMessageStart, Params().MessageStart(), sizeof(metadata.pchMessageStart)))
+        return error("%s : snapshot is for a different network", __func__);
+    if (metadata.nSnapshotVersion != COINS_SNAPSHOT_VERSION)
+        return error("%s : unsupported snapshot version %u", __func__, metadata.nSnapshotVersion);
+    if (metadata.nHeight < 0 || metadata.nBlockIndexEntries != (uint64_t)metadata.nHeight + 1)
+        return error("%s : malformed snapshot header", __func__);
+
+    LogPrintf("%s: loading %u coins at height %d (%s)\n", __func__, metadata.nCoins, metadata.nHeight, metadata.hashBlock.ToString());
+
+    // The entries written below are not part of any block index snapshot
+    if (!pblocktree->WriteInt(BLOCK_INDEX_SNAPSHOT_MARKER, 0))
+        return error("%s : failed to invalidate block index snapshot", __func__);
+
+    // Header chain: every entry must link to the previous one, start at our
+    // genesis and agree with the built-in checkpoints. Headers are written in
+    // chunks to keep memory bounded on long chains.
+    std::vector<CDiskBlockIndex> vindex;
+    vindex.reserve(10000);
+    uint256 hashPrev = 0;
+    for (int nHeight = 0; nHeight <= metadata.nHeight; nHeight++) {
+        boost::this_thread::interruption_point();
+        CDiskBlockIndex diskindex;
+        try {
+            filein >> diskindex;
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error at height %d - %s", __func__, nHeight, e.what());
+        }
+        uint256 hash = diskindex.GetBlockHash();
+        if (diskindex.nHeight != nHeight || diskindex.hashPrev != hashPrev)
+            return error("%s : block index entry at height %d does not connect", __func__, nHeight);
+        if (nHeight == 0 && hash != Params().HashGenesisBlock())
+            return error("%s : snapshot has a different genesis block", __func__);
+        if (!Checkpoints::CheckBlock(nHeight, hash))
+            return error("%s : block index entry at height %d rejected by checkpoint", __func__, nHeight);
+        diskindex.nStatus = (diskindex.nStatus & ~BLOCK_HAVE_MASK) | BLOCK_HAVE_SNAPSHOT;
+        vindex.push_back(diskindex);
+        hashPrev = hash;
+
+        if (vindex.size() == 10000) {
+            if (!pblocktree->WriteBlockIndexes(vindex))
+                return error("%s : failed to write block index", __func__);
+            vindex.clear();
+        }
+    }
+    if (hashPrev != metadata.hashBlock)
+        return error("%s : block index does not end at the snapshot block", __func__);
+    if (!pblocktree->WriteBlockIndexes(vindex))
+        return error("%s : failed to write block index", __func__);
+
+    // The block tree is initialized here instead of in InitBlockIndex(), which
+    // is skipped because a genesis block is already present.
+    fTxIndex = GetBoolArg("-txindex", true);
+    pblocktree->WriteFlag("txindex", fTxIndex);
+    fAddrIndex = GetBoolArg("-addrindex", DEFAULT_ADDRINDEX);
+    pblocktree->WriteFlag("addrindex", fAddrIndex);
+
+    if (!pcoinsview->LoadSnapshot(filein, metadata))
+        return error("%s : failed to load coins", __func__);
+
+    LogPrintf("%s: UTXO snapshot loaded, commitment %s\n", __func__, metadata.hashCommitment.ToString());
+    return true;
 }
 
+//! Version of the mempool.dat format written by DumpMempool
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+//! Number of saved transactions LoadMempool submits per cs_main acquisition
+static const unsigned int MEMPOOL_LOAD_BATCH_SIZE = 100;
 
-void static CheckBlockIndex()
+static boost::filesystem::path GetMempoolPath()
 {
-    if (!fCheckBlockIndex) {
+    return GetDataDir() / "mempool.dat";
+}
+
+/** Append it to vinfo after all of its in-mempool ancestors (requires mempool.cs) */
+static void AddMempoolEntryInOrder(CTxMemPool::txiter it, std::set<uint256>& setAdded, std::vector<std::pair<CTransaction, int64_t> >& vinfo)
+{
+    if (!setAdded.insert(it->GetTx().GetHash()).second)
         return;
+    BOOST_FOREACH (const CTxMemPool::txiter& parent, mempool.GetMemPoolParents(it))
+        AddMempoolEntryInOrder(parent, setAdded, vinfo);
+    vinfo.push_back(std::make_pair(it->GetTx(), it->GetTime()));
+}
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMicros();
+
+    // Parents are written before their children so that LoadMempool can
+    // accept every transaction in a single pass.
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::vector<std::pair<CTransaction, int64_t> > vinfo;
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        vinfo.reserve(mempool.mapTx.size());
+        std::set<uint256> setAdded;
+        for (CTxMemPool::txiter it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it)
+            AddMempoolEntryInOrder(it, setAdded, vinfo);
     }
 
-    LOCK(cs_main);
+    int64_t nMid = GetTimeMicros();
+
+    boost::filesystem::path pathTmp = GetMempoolPath().string() + ".new";
+    CAutoFile fileout(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("%s : failed to open %s", __func__, pathTmp.string());
+
+    try {
+        fileout << MEMPOOL_DUMP_VERSION;
+        fileout << mapDeltas;
+        fileout << (uint64_t)vinfo.size();
+        for (std::vector<std::pair<CTransaction, int64_t> >::const_iterator it = vinfo.begin(); it != vinfo.end(); ++it)
+            fileout << it->first << it->second;
+    } catch (const std::exception& e) {
+        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+    }
+
+    FileCommit(fileout.Get());
+    fileout.fclose();
+    if (!RenameOver(pathTmp, GetMempoolPath()))
+        return error("%s : rename failed", __func__);
+
+    LogPrintf("%s: dumped %u transactions, %gs to copy, %gs to write\n", __func__, vinfo.size(),
+        (nMid - nStart) * 0.000001, (GetTimeMicros() - nMid) * 0.000001);
+    return true;
+}
+
+bool LoadMempool()
+{
+    CAutoFile filein(fopen(GetMempoolPath().string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull()) {
+        LogPrintf("%s: no mempool.dat to load\n", __func__);
+        return false;
+    }
+
+    int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY_LEGACY) * 60 * 60;
+    int64_t nNow = GetTime();
+    unsigned int nAccepted = 0, nFailed = 0, nExpired = 0, nAlreadyThere = 0;
+
+    try {
+        uint64_t nVersion;
+        filein >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("%s : unsupported mempool.dat version %u", __func__, nVersion);
+
+        // Deltas first, so prioritised transactions pass the fee checks again
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        filein >> mapDeltas;
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+            mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+
+        uint64_t nRemaining;
+        filein >> nRemaining;
+        while (nRemaining > 0) {
+            boost::this_thread::interruption_point();
+
+            // Release cs_main between batches so block processing and RPC
+            // calls are not held up by a large mempool.dat
+            LOCK(cs_main);
+            for (unsigned int i = 0; i < MEMPOOL_LOAD_BATCH_SIZE && nRemaining > 0; i++, nRemaining--) {
+                CTransaction tx;
+                int64_t nTime;
+                filein >> tx >> nTime;
+
+                CValidationState state;
+                if (nTime + nExpiryTimeout <= nNow)
+                    nExpired++;
+                else if (mempool.exists(tx.GetHash()))
+                    nAlreadyThere++;
+                else if (AcceptToMemoryPool(mempool, state, tx, true, NULL, false, false, false, false, nTime))
+                    nAccepted++;
+                else
+                    nFailed++;
+            }
+        }
+    } catch (const std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+
+    LogPrintf("%s: imported mempool transactions from disk: %u accepted, %u failed, %u expired, %u already there\n",
+        __func__, nAccepted, nFailed, nExpired, nAlreadyThere);
+    return true;
+}
+
+namespace
+{
+/** A block record found in an external block file, carried through CBlockImportPipeline */
+struct CBlockImportJob {
+    std::vector<char> vData; //! raw serialized block, released once decoded
+    unsigned int nSize;
+    CDiskBlockPos pos;
+    CBlock block;
+    uint256 hash;
+    CValidationState state;
+    bool fDecoded;
+    bool fChecked;
+
+    CBlockImportJob() : nSize(0), fDecoded(false), fChecked(false) {}
+};
+
+/**
+ * Block import pipeline used by LoadExternalBlockFile. A reader thread scans
+ * the file for block records and copies out their raw bytes with large
+ * sequential reads, a pool of workers deserializes them and runs the checks
+ * that don't depend on the chain (CheckBlock including proof of work, and the
+ * block signature), and the calling thread takes the results back in file
+ * order to connect them.
+ */
+class CBlockImportPipeline
+{
+private:
+    //! Mutex to protect the inner state
+    boost::mutex mutex;
+
+    //! Reader thread blocks on this while too many bytes are in flight
+    boost::condition_variable condReader;
+
+    //! Worker threads block on this when out of work
+    boost::condition_variable condWorker;
+
+    //! The connector blocks on this until the next record in file order is checked
+    boost::condition_variable condConnector;
+
+    //! Records read but not yet picked up by a worker, with their position in the file
+    std::deque<std::pair<uint64_t, boost::shared_ptr<CBlockImportJob> > > queueRead;
+
+    //! Checked records waiting for the connector
+    std::map<uint64_t, boost::shared_ptr<CBlockImportJob> > mapChecked;
+
+    uint64_t nRead;
+    uint64_t nConnected;
+    uint64_t nBytesInFlight;
+    bool fReadDone;
+    bool fStop;
+
+    boost::thread_group threadGroup;
+
+    bool Push(const boost::shared_ptr<CBlockImportJob>& job)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fStop && nBytesInFlight > 0 && nBytesInFlight + job->nSize > MAX_BLOCK_IMPORT_BYTES_IN_FLIGHT)
+            condReader.wait(lock);
+        if (fStop)
+            return false;
+        nBytesInFlight += job->nSize;
+        queueRead.push_back(std::make_pair(nRead++, job));
+        condWorker.notify_one();
+        return true;
+    }
+
+    void ThreadRead(FILE* fileIn, CDiskBlockPos pos, bool fHavePos)
+    {
+        RenameThread("kore-impread");
+        try {
+            // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
+            CBufferedFile blkdat(fileIn, std::max(2 * MAX_BLOCK_SIZE, (unsigned int)BLOCKFILE_CHUNK_SIZE), MAX_BLOCK_SIZE + 8, SER_DISK, CLIENT_VERSION);
+            uint64_t nRewind = blkdat.GetPos();
+            while (!blkdat.eof()) {
+                blkdat.SetPos(nRewind);
+                nRewind++;         // start one byte further next time, in case of failure
+                blkdat.SetLimit(); // remove former limit
+                unsigned int nSize = 0;
+                try {
+                    // locate a header
+                    unsigned char buf[MESSAGE_START_SIZE];
+                    blkdat.FindByte(Params().MessageStart()[0]);
+                    nRewind = blkdat.GetPos() + 1;
+                    blkdat >> FLATDATA(buf);
+                    if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+                        continue;
+                    // read size
+                    blkdat >> nSize;
+                    if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                        continue;
+                } catch (const std::exception&) {
+                    // no valid block header found; don't complain
+                    break;
+                }
+                try {
+                    // copy out the raw block, the workers deserialize it
+                    boost::shared_ptr<CBlockImportJob> job(new CBlockImportJob());
+                    uint64_t nBlockPos = blkdat.GetPos();
+                    if (fHavePos) {
+                        job->pos = pos;
+                        job->pos.nPos = nBlockPos;
+                    }
+                    job->nSize = nSize;
+                    job->vData.resize(nSize);
+                    blkdat.SetLimit(nBlockPos + nSize);
+                    blkdat.read(&job->vData[0], nSize);
+                    nRewind = blkdat.GetPos();
+                    if (!Push(job))
+                        break;
+                } catch (const std::exception& e) {
+                    LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+                }
+            }
+        } catch (const std::exception& e) {
+            LogPrintf("%s : I/O error - %s\n", __func__, e.what());
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fReadDone = true;
+        condWorker.notify_all();
+        condConnector.notify_all();
+    }
+
+    void Check(CBlockImportJob& job)
+    {
+        try {
+            CDataStream ss(job.vData, SER_DISK, CLIENT_VERSION);
+            ss >> job.block;
+        } catch (const std::exception& e) {
+            LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+            return;
+        }
+        std::vector<char>().swap(job.vData);
+        job.fDecoded = true;
+        job.hash = job.block.GetHash();
+
+        {
+            // Blocks we already have are skipped by the connector, don't pay for checking them
+            TRY_LOCK(cs_main, lockMain);
+            if (lockMain) {
+                BlockMap::iterator mi = mapBlockIndex.find(job.hash);
+                if (mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                    return;
+            }
+        }
+
+        // CheckBlock_Legacy caches its result in CBlock::fChecked, the new rules get fAlreadyChecked
+        if (UseLegacyCode(job.block))
+            job.fChecked = CheckBlock_Legacy(job.block, job.state);
+        else
+            job.fChecked = CheckBlock(job.block, job.state) && CheckBlockSignature(job.block);
+    }
+
+    void ThreadCheck()
+    {
+        RenameThread("kore-impcheck");
+        while (true) {
+            std::pair<uint64_t, boost::shared_ptr<CBlockImportJob> > item;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && !fReadDone && queueRead.empty())
+                    condWorker.wait(lock);
+                if (fStop || queueRead.empty())
+                    return;
+                item = queueRead.front();
+                queueRead.pop_front();
+            }
+
+            Check(*item.second);
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            mapChecked.insert(item);
+            if (item.first == nConnected)
+                condConnector.notify_one();
+        }
+    }
+
+public:
+    CBlockImportPipeline(FILE* fileIn, const CDiskBlockPos* dbp) : nRead(0), nConnected(0), nBytesInFlight(0), fReadDone(false), fStop(false)
+    {
+        int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency() - 1, MAX_BLOCK_IMPORT_THREADS));
+        threadGroup.create_thread(boost::bind(&CBlockImportPipeline::ThreadRead, this, fileIn, dbp ? *dbp : CDiskBlockPos(), dbp != NULL));
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CBlockImportPipeline::ThreadCheck, this));
+    }
+
+    ~CBlockImportPipeline()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+        }
+        condReader.notify_all();
+        condWorker.notify_all();
+        threadGroup.join_all();
+    }
+
+    //! Return the next checked record in file order, or an empty pointer once the whole file was processed
+    boost::shared_ptr<CBlockImportJob> Next()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (true) {
+            if (!mapChecked.empty() && mapChecked.begin()->first == nConnected) {
+                boost::shared_ptr<CBlockImportJob> job = mapChecked.begin()->second;
+                mapChecked.erase(mapChecked.begin());
+                nConnected++;
+                nBytesInFlight -= job->nSize;
+                condReader.notify_one();
+                return job;
+            }
+            if (fReadDone && nConnected == nRead)
+                return boost::shared_ptr<CBlockImportJob>();
+            condConnector.wait(lock);
+        }
+    }
+};
+} // anon namespace
+
+bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
+{
+    // Map of disk positions for blocks with unknown parent (only used for reindex)
+    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+    int64_t nStart = GetTimeMillis();
+    const CChainParams& chainparams = Params();
+
+    int nLoaded = 0;
+    try {
+        // Reading and context-free checks run ahead on their own threads, blocks are connected here in file order
+        CBlockImportPipeline pipeline(fileIn, dbp);
+        while (true) {
+            boost::this_thread::interruption_point();
+
+            boost::shared_ptr<CBlockImportJob> job = pipeline.Next();
+            if (!job)
+                break;
+            if (!job->fDecoded)
+                continue;
+            try {
+                CBlock& block = job->block;
+                const uint256& hash = job->hash;
+                CDiskBlockPos* pos = dbp ? &job->pos : NULL;
+
+                // detect out of order blocks, and store them for later
+                if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
+                    if (dbp)
+                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, job->pos));
+                    continue;
+                }
+
+                // process in case the block isn't known yet
+                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+                    if (!job->fChecked) {
+                        LogPrintf("%s : block %s failed checks: %s\n", __func__, hash.ToString(), job->state.GetRejectReason());
+                        continue;
+                    }
+                    CValidationState state;
+                    if (UseLegacyCode(block)) {
+                        if (ProcessNewBlock_Legacy(state, chainparams, NULL, &block, true, pos))
+                            nLoaded++;
+                    } else {
+                        if (ProcessNewBlock(state, NULL, &block, pos, true))
+                            nLoaded++;
+                    }
+                    if (state.IsError())
+                        break;
+                } else if (hash != Params().HashGenesisBlock() && mapBlockIndex[hash]->nHeight % 1000 == 0 && fDebug)
+                    LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+
+                // Recursively process earlier encountered successors of this block
+                deque<uint256> queue;
+                queue.push_back(hash);
+                while (!queue.empty()) {
+                    uint256 head = queue.front();
+                    queue.pop_front();
+                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+                    while (range.first != range.second) {
+                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+                        if (ReadBlockFromDisk(block, it->second)) {
+                            if (fDebug)
+                                LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(), head.ToString());
+                            
+                            CValidationState dummy;
+                            if (UseLegacyCode(block)) {
+                                if (ProcessNewBlock_Legacy(dummy, chainparams, NULL, &block, true, &it->second))
+                                    nLoaded++;
+                            } else if (ProcessNewBlock(dummy, NULL, &block, &it->second))
+                                nLoaded++;
+                            queue.push_back(block.GetHash());
+                        }
+                        range.first++;
+                        mapBlocksUnknownParent.erase(it);
+                    }
+                }
+            } catch (std::exception& e) {
+                LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+            }
+        }
+    } catch (std::runtime_error& e) {
+        AbortNode(std::string("System error: ") + e.what());
+    }
+    if (fDebug)
+        LogPrintf("LoadExternalBlockFile Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
+    
+    return nLoaded > 0;
+}
+
+
+void static CheckBlockIndex()
+{
+    if (!fCheckBlockIndex) {
+        return;
+    }
+
+    LOCK(cs_main);
 
     // During a reindex, we read the genesis block and call CheckBlockIndex before ActivateBestChain,
     // so we have the genesis block in mapBlockIndex but no active chain.  (A few of the tests when
@@ -6037,6 +6844,46 @@ bool static AlreadyHave(const CInv& inv)
 }
 
 
+/** The last block message framed by ReadRawBlockMessage, for peers asking for the same block. Protected by cs_main. */
+static uint256 hashLastRawBlock;
+static CSerializedNetMsg msgLastRawBlock;
+
+/**
+ * Frame the block at pindex as a block message straight from its bytes in
+ * the block file, without deserializing, hashing and serializing it again.
+ * Fails when the block file can't be mapped or the stored header doesn't
+ * match the index; the caller then goes through ReadBlockFromDisk.
+ */
+// Requires cs_main.
+static bool ReadRawBlockMessage(CSerializedNetMsg& msg, const CBlockIndex* pindex)
+{
+    if (msgLastRawBlock && hashLastRawBlock == pindex->GetBlockHash()) {
+        msg = msgLastRawBlock;
+        return true;
+    }
+
+    CBlockFileReader mapped(SER_DISK, CLIENT_VERSION);
+    if (!blockFileCache.Open(pindex->GetBlockPos(), "blk", 0, mapped))
+        return false;
+
+    // Make sure the record is the block we expect, without the cost of hashing it
+    CBlockHeader header;
+    try {
+        CBlockFileReader headerReader(mapped);
+        headerReader >> header;
+    } catch (std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    if (header.hashMerkleRoot != pindex->hashMerkleRoot || header.nTime != pindex->nTime || header.nNonce != pindex->nNonce ||
+        (pindex->pprev && header.hashPrevBlock != pindex->pprev->GetBlockHash()))
+        return error("%s : block at %s doesn't match index entry %s", __func__, pindex->GetBlockPos().ToString(), pindex->GetBlockHash().ToString());
+
+    msg = MakeSerializedNetMsg(NetMsgType::BLOCK, mapped.data(), mapped.size());
+    hashLastRawBlock = pindex->GetBlockHash();
+    msgLastRawBlock = msg;
+    return true;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -6055,7 +6902,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK) {
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK) {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end()) {
@@ -6084,30 +6931,44 @@ void static ProcessGetData(CNode* pfrom)
                 // Pruned nodes may have deleted the block, so check whether
                 // it's available before trying to send.
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage(NetMsgType::BLOCK, block);
-                    else // MSG_FILTERED_BLOCK)
-                    {
-                        LOCK(pfrom->cs_filter);
-                        if (pfrom->pfilter) {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
-                            pfrom->PushMessage(NetMsgType::MERKLEBLOCK, merkleBlock);
-                            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                            // This avoids hurting performance by pointlessly requiring a round-trip
-                            // Note that there is currently no way for a node to request any single transactions we didn't send here -
-                            // they must either disconnect and retry or request the full block.
-                            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                            // however we MUST always provide at least what the remote peer needs
-                            typedef std::pair<unsigned int, uint256> PairType;
-                            BOOST_FOREACH (PairType& pair, merkleBlock.vMatchedTxn)
-                                pfrom->PushMessage(NetMsgType::TX, block.vtx[pair.first]);
+                    CSerializedNetMsg msgRawBlock;
+                    if (inv.type == MSG_BLOCK && ReadRawBlockMessage(msgRawBlock, mi->second)) {
+                        // Send the block as it is stored in its block file
+                        pfrom->PushSerializedMessage(msgRawBlock);
+                    } else {
+                        // Send block from the block cache or disk
+                        boost::shared_ptr<const CBlock> pblock;
+                        if (!ReadBlockFromDisk(pblock, (*mi).second))
+                            assert(!"cannot load block from disk");
+                        const CBlock& block = *pblock;
+                        if (inv.type == MSG_BLOCK)
+                            pfrom->PushMessage(NetMsgType::BLOCK, block);
+                        else if (inv.type == MSG_FILTERED_BLOCK) {
+                            LOCK(pfrom->cs_filter);
+                            if (pfrom->pfilter) {
+                                CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                                pfrom->PushMessage(NetMsgType::MERKLEBLOCK, merkleBlock);
+                                // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+                                // This avoids hurting performance by pointlessly requiring a round-trip
+                                // Note that there is currently no way for a node to request any single transactions we didn't send here -
+                                // they must either disconnect and retry or request the full block.
+                                // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+                                // however we MUST always provide at least what the remote peer needs
+                                typedef std::pair<unsigned int, uint256> PairType;
+                                BOOST_FOREACH (PairType& pair, merkleBlock.vMatchedTxn)
+                                    pfrom->PushMessage(NetMsgType::TX, block.vtx[pair.first]);
+                            }
+                            // else
+                            // no response
+                        } else { // MSG_CMPCT_BLOCK
+                            // A peer asking for an old block won't have a mempool
+                            // that helps rebuilding it, so send it in full
+                            if (mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
+                                CBlockHeaderAndShortTxIDs cmpctblock(block);
+                                pfrom->PushMessage(NetMsgType::CMPCTBLOCK, cmpctblock);
+                            } else
+                                pfrom->PushMessage(NetMsgType::BLOCK, block);
                         }
-                        // else
-                        // no response
                     }
 
                     // Trigger the peer node to send a getblocks request for the next batch of inventory
@@ -6126,19 +6987,19 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CRelayedTx>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        // Serialize the message once for all the peers asking for it
+                        if (!mi->second.msg)
+                            mi->second.msg = MakeSerializedNetMsg(inv.GetCommand(), *mi->second.tx);
+                        pfrom->PushSerializedMessage(mi->second.msg);
                         pushed = true;
                     }
                 }
                 if (!pushed && inv.type == MSG_TX) {
-                    CTransaction tx;
-                    if (mempool.lookup(inv.hash, tx)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage(NetMsgType::TX, ss);
+                    CTransactionRef ptx = mempool.get(inv.hash);
+                    if (ptx) {
+                        pfrom->PushMessage(NetMsgType::TX, *ptx);
                         pushed = true;
                     }
                 }
@@ -6151,7 +7012,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -6170,17 +7031,60 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
-bool static ProcessMessageBlock(CNode* pfrom, string strCommand, CDataStream& vRecv)
+bool CanDirectFetch()
+{
+    return chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - Params().GetTargetTimespan() * 20;
+}
+
+/** Validate a block received in full or rebuilt from a cmpctblock, and reject it to the peer if invalid */
+void static ProcessReconstructedBlock(CNode* pfrom, CBlock& block, const string& strCommand)
 {
     const CChainParams& chainparams = Params();
+    uint256 hashBlock = block.GetHash();
+    CInv inv(MSG_BLOCK, hashBlock);
+    pfrom->AddInventoryKnown(inv);
+
+    CValidationState state;
+    CBlockIndex* prevBlockIndex;
+    {
+        LOCK(cs_main);
+        prevBlockIndex = mapBlockIndex[block.hashPrevBlock];
+    }
+    if (UseLegacyCode(prevBlockIndex->nHeight + 1)) {
+        // Process all blocks from whitelisted peers, even if not requested,
+        // unless we're still syncing with the network.
+        // Such an unrequested block may still be processed, subject to the
+        // conditions in AcceptBlock().
+        bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload();
+        ProcessNewBlock_Legacy(state, chainparams, pfrom, &block, forceProcessing, NULL);
+    } else
+        ProcessNewBlock(state, pfrom, &block, NULL);
+
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        assert(state.GetRejectCode() < REJECT_INTERNAL_LEGACY); // Blocks are never rejected with internal reject codes
+        pfrom->PushMessage(NetMsgType::REJECT, strCommand, (unsigned char)state.GetRejectCode(),
+            state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS, state.GetRejectReason());
+        }
+    } else if (!IsInitialBlockDownload()) {
+        // The peer that gave us our new tip is a good candidate to hear the next one from first
+        LOCK(cs_main);
+        if (chainActive.Tip()->GetBlockHash() == hashBlock)
+            MaybeSetPeerAsAnnouncingHeaderAndIDs(pfrom);
+    }
+}
 
+bool static ProcessMessageBlock(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
     // If we are in the last block and a new block has arrived
     // than it need to be processed by the new chain
     CBlock block;
     vRecv >> block;
     uint256 hashBlock = block.GetHash();
-    CInv inv(MSG_BLOCK, hashBlock);
-    LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
+    LogPrint("net", "received block %s peer=%d\n", hashBlock.ToString(), pfrom->id);
 
     //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
     if (!mapBlockIndex.count(block.hashPrevBlock)) {
@@ -6193,37 +7097,244 @@ bool static ProcessMessageBlock(CNode* pfrom, string strCommand, CDataStream& vR
             pfrom->PushMessage("getblocks", chainActive.GetLocator(), hashBlock);
             pfrom->vBlockRequested.push_back(hashBlock);
         }
-    } else {
-        pfrom->AddInventoryKnown(inv);
+    } else
+        ProcessReconstructedBlock(pfrom, block, strCommand);
 
+    return true;
+}
+
+bool static ProcessMessageSendCmpct(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    bool fAnnounceUsingCMPCTBLOCK = false;
+    uint64_t nCMPCTBLOCKVersion = 0;
+    vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+    if (nCMPCTBLOCKVersion == CMPCTBLOCKS_VERSION) {
+        LOCK(cs_main);
+        CNodeState* nodestate = State(pfrom->GetId());
+        nodestate->fProvidesHeaderAndIDs = true;
+        nodestate->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+    }
+    return true;
+}
+
+/**
+ * Complete the block pfrom is sending us as a cmpctblock with the transactions
+ * that were missing from our mempool. Falls back to requesting the full block
+ * if the result does not match the merkle root.
+ */
+// Requires cs_main.
+bool static FillPartialBlock(CNode* pfrom, const uint256& hash, const std::vector<CTransaction>& vtx_missing, CBlock& block)
+{
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight == mapBlocksInFlight.end() || !itInFlight->second.second->partialBlock ||
+        itInFlight->second.first != pfrom->GetId()) {
+        LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+        return false;
+    }
+
+    boost::shared_ptr<PartiallyDownloadedBlock> partialBlock = itInFlight->second.second->partialBlock;
+    itInFlight->second.second->partialBlock.reset();
+    ReadStatus status = partialBlock->FillBlock(block, vtx_missing);
+    if (status == READ_STATUS_INVALID) {
+        MarkBlockAsReceived_Legacy(hash); // Reset in-flight state in case of whitelist
+        Misbehaving(pfrom->GetId(), 100, "Invalid blocktxn");
+        return error("%s : peer %d sent us invalid compact block/non-matching block transactions", __func__, pfrom->id);
+    } else if (status == READ_STATUS_FAILED) {
+        // Might have collided, fall back to getdata now
+        vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+        pfrom->PushMessage(NetMsgType::GETDATA, vInv);
+        return false;
+    }
+    return true;
+}
+
+bool static ProcessMessageCmpctBlock(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    CBlockHeaderAndShortTxIDs cmpctblock;
+    vRecv >> cmpctblock;
+
+    CBlock block;
+    {
+        LOCK(cs_main);
+
+        if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+            // Doesn't connect (or is genesis), instead of DoSing in AcceptBlockHeader, request deeper headers
+            if (!IsInitialBlockDownload())
+                pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), uint256());
+            return true;
+        }
+
+        CBlockIndex* pindex = NULL;
         CValidationState state;
-        CBlockIndex* prevBlockIndex = mapBlockIndex[block.hashPrevBlock];
-        if (UseLegacyCode(prevBlockIndex->nHeight + 1)) {
-            // Process all blocks from whitelisted peers, even if not requested,
-            // unless we're still syncing with the network.
-            // Such an unrequested block may still be processed, subject to the
-            // conditions in AcceptBlock().
-            bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload();
-            ProcessNewBlock_Legacy(state, chainparams, pfrom, &block, forceProcessing, NULL);
-        } else
-            ProcessNewBlock(state, pfrom, &block, NULL);
+        if (!AcceptBlockHeader(cmpctblock.header, state, &pindex)) {
+            int nDoS;
+            if (state.IsInvalid(nDoS)) {
+                if (nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS, "Invalid cmpctblock header");
+                return error("%s : invalid header received in cmpctblock from peer=%d", __func__, pfrom->id);
+            }
+            return true;
+        }
 
-        int nDoS;
-        if (state.IsInvalid(nDoS)) {
-            assert(state.GetRejectCode() < REJECT_INTERNAL_LEGACY); // Blocks are never rejected with internal reject codes
-            pfrom->PushMessage(NetMsgType::REJECT, strCommand, (unsigned char)state.GetRejectCode(),
-                state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0) {
-                LOCK(cs_main);
-                Misbehaving(pfrom->GetId(), nDoS, state.GetRejectReason());
+        uint256 hash = pindex->GetBlockHash();
+        UpdateBlockAvailability(pfrom->GetId(), hash);
+        LogPrint("net", "received cmpctblock %s peer=%d\n", hash.ToString(), pfrom->id);
+
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+        bool fAlreadyInFlight = itInFlight != mapBlocksInFlight.end();
+
+        if (pindex->nStatus & BLOCK_HAVE_DATA) // Nothing to do here
+            return true;
+
+        if (pindex->nChainWork <= chainActive.Tip()->nChainWork || // We know something better
+            pindex->nTx != 0) {                                     // We had this block at some point, but pruned it
+            if (fAlreadyInFlight) {
+                // We requested this block for some reason, but our mempool will probably be useless
+                // so we just grab the block via normal getdata
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                pfrom->PushMessage(NetMsgType::GETDATA, vInv);
+            }
+            return true;
+        }
+
+        // If we're not close to tip yet, give up and let parallel block fetch work its magic
+        if (!fAlreadyInFlight && !CanDirectFetch())
+            return true;
+
+        // Only rebuild blocks that extend our tip, anything else is fetched in full
+        if (pindex->nHeight > chainActive.Height() + 2) {
+            if (fAlreadyInFlight) {
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                pfrom->PushMessage(NetMsgType::GETDATA, vInv);
+            }
+            return true;
+        }
+
+        std::vector<CTransactionRef> vExtraTxn;
+        vExtraTxn.reserve(mapOrphanTransactions.size());
+        for (boost::unordered_map<uint256, COrphanTx, CCoinsKeyHasher>::const_iterator mi = mapOrphanTransactions.begin(); mi != mapOrphanTransactions.end(); ++mi)
+            vExtraTxn.push_back(mi->second.tx);
+
+        CNodeState* nodestate = State(pfrom->GetId());
+        if ((!fAlreadyInFlight && nodestate->nBlocksInFlight < GetBlocksInTransitLimit(nodestate)) ||
+            (fAlreadyInFlight && itInFlight->second.first == pfrom->GetId())) {
+            if (!fAlreadyInFlight) {
+                MarkBlockAsInFlight_Legacy(pfrom->GetId(), hash, pindex);
+                itInFlight = mapBlocksInFlight.find(hash);
+            } else if (itInFlight->second.second->partialBlock) {
+                // We are already rebuilding this block from an earlier cmpctblock of this peer
+                return true;
             }
+
+            boost::shared_ptr<PartiallyDownloadedBlock> partialBlock(new PartiallyDownloadedBlock(&mempool));
+            ReadStatus status = partialBlock->InitData(cmpctblock, vExtraTxn);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived_Legacy(hash); // Reset in-flight state in case of whitelist
+                Misbehaving(pfrom->GetId(), 100, "Invalid cmpctblock");
+                return error("%s : peer %d sent us invalid compact block", __func__, pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                // Duplicate txindexes, the block is now in-flight, so just request it
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                pfrom->PushMessage(NetMsgType::GETDATA, vInv);
+                return true;
+            }
+            itInFlight->second.second->partialBlock = partialBlock;
+
+            BlockTransactionsRequest req;
+            for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                if (!partialBlock->IsTxAvailable(i))
+                    req.indexes.push_back(i);
+            }
+            if (!req.indexes.empty()) {
+                req.blockhash = hash;
+                pfrom->PushMessage(NetMsgType::GETBLOCKTXN, req);
+                return true;
+            }
+            if (!FillPartialBlock(pfrom, hash, std::vector<CTransaction>(), block))
+                return true;
+        } else {
+            // The block is in flight from another peer, or this peer has too
+            // many blocks outstanding. Try to rebuild it anyway, as that costs
+            // no round trip if our mempool has every transaction.
+            PartiallyDownloadedBlock tempBlock(&mempool);
+            if (tempBlock.InitData(cmpctblock, vExtraTxn) != READ_STATUS_OK)
+                return true;
+            for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                if (!tempBlock.IsTxAvailable(i))
+                    return true;
+            }
+            if (tempBlock.FillBlock(block, std::vector<CTransaction>()) != READ_STATUS_OK)
+                return true;
         }
     }
 
+    ProcessReconstructedBlock(pfrom, block, NetMsgType::BLOCK);
+
     return true;
 }
 
-bool static ProcessMessageReject(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+bool static ProcessMessageGetBlockTxn(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    BlockTransactionsRequest req;
+    vRecv >> req;
+
+    LOCK(cs_main);
+
+    BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+    if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+        LogPrint("net", "Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+        return true;
+    }
+
+    if (mi->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+        // If an older block is requested (should never happen in practice,
+        // but can happen in tests) send a block response instead of a
+        // blocktxn response. Sending a full block response instead of a
+        // small blocktxn response is preferable in the case where a peer
+        // might maliciously send lots of getblocktxn requests to trigger
+        // expensive disk reads, because it will require the peer to
+        // actually receive all the data read from disk over the network.
+        LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+        pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+        ProcessGetData(pfrom);
+        return true;
+    }
+
+    boost::shared_ptr<const CBlock> pblock;
+    if (!ReadBlockFromDisk(pblock, mi->second))
+        assert(!"cannot load block from disk");
+
+    BlockTransactions resp(req);
+    for (size_t i = 0; i < req.indexes.size(); i++) {
+        if (req.indexes[i] >= pblock->vtx.size()) {
+            Misbehaving(pfrom->GetId(), 100, "Out-of-bound tx index in getblocktxn");
+            return error("%s : peer %d sent us a getblocktxn with out-of-bounds tx indices", __func__, pfrom->id);
+        }
+        resp.txn[i] = pblock->vtx[req.indexes[i]];
+    }
+    pfrom->PushMessage(NetMsgType::BLOCKTXN, resp);
+
+    return true;
+}
+
+bool static ProcessMessageBlockTxn(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    BlockTransactions resp;
+    vRecv >> resp;
+
+    CBlock block;
+    {
+        LOCK(cs_main);
+        if (!FillPartialBlock(pfrom, resp.blockhash, resp.txn, block))
+            return true;
+    }
+
+    ProcessReconstructedBlock(pfrom, block, NetMsgType::BLOCK);
+
+    return true;
+}
+
+bool static ProcessMessageReject(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     try {
         string strMsg;
@@ -6247,7 +7358,7 @@ bool static ProcessMessageReject(CNode* pfrom, string strCommand, CDataStream& v
     }
 }
 
-bool static ProcessMessagePing(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+bool static ProcessMessagePing(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     if (pfrom->nVersion > BIP0031_VERSION) {
         uint64_t nonce = 0;
@@ -6279,7 +7390,7 @@ bool static ProcessMessagePing(CNode* pfrom, string strCommand, CDataStream& vRe
     return true;
 }
 
-bool static ProcessMessagePong(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+bool static ProcessMessagePong(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     int64_t pingUsecEnd = nTimeReceived;
     uint64_t nonce = 0;
@@ -6337,7 +7448,7 @@ bool static ProcessMessagePong(CNode* pfrom, string strCommand, CDataStream& vRe
     return true;
 }
 
-bool static ProcessMessageGetBlocks(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+bool static ProcessMessageGetBlocks(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     const CChainParams& chainparams = Params();
     CBlockLocator locator;
@@ -6378,12 +7489,7 @@ bool static ProcessMessageGetBlocks(CNode* pfrom, string strCommand, CDataStream
     return true;
 }
 
-bool CanDirectFetch()
-{
-    return chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - Params().GetTargetTimespan() * 20;
-}
-
-bool ProcessMessageHeaders(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+bool static ProcessMessageHeaders(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     std::vector<CBlockHeader> headers;
 
@@ -6406,6 +7512,34 @@ bool ProcessMessageHeaders(CNode* pfrom, string strCommand, CDataStream& vRecv,
         return true;
     }
 
+    CNodeState* nodestate = State(pfrom->GetId());
+
+    // If this looks like it could be a block announcement (nCount <
+    // MAX_BLOCKS_TO_ANNOUNCE), use special logic for handling headers that
+    // don't connect:
+    // - Send a getheaders message in response to try to connect the chain.
+    // - The peer can send up to MAX_UNCONNECTING_HEADERS in a row that
+    //   don't connect before giving DoS points
+    // - Once a headers message is received that is valid and does connect,
+    //   nUnconnectingHeaders gets reset back to 0.
+    if (mapBlockIndex.find(headers[0].hashPrevBlock) == mapBlockIndex.end() && nCount < MAX_BLOCKS_TO_ANNOUNCE_LEGACY) {
+        nodestate->nUnconnectingHeaders++;
+        pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), uint256());
+        LogPrint("net", "received header %s: missing prev block %s, sending getheaders (%d) to end (peer=%d, nUnconnectingHeaders=%d)\n",
+            headers[0].GetHash().ToString(),
+            headers[0].hashPrevBlock.ToString(),
+            pindexBestHeader->nHeight,
+            pfrom->id, nodestate->nUnconnectingHeaders);
+        // Set hashLastUnknownBlock for this peer, so that if we
+        // eventually get the headers - even from a different peer -
+        // we can use this peer to download.
+        UpdateBlockAvailability(pfrom->GetId(), headers.back().GetHash());
+
+        if (nodestate->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0)
+            Misbehaving(pfrom->GetId(), 20, "Too many unconnecting headers");
+        return true;
+    }
+
     CBlockIndex* pindexLast = NULL;
     BOOST_FOREACH (const CBlockHeader& header, headers) {
         CValidationState state;
@@ -6423,10 +7557,16 @@ bool ProcessMessageHeaders(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
     }
 
-    if (pindexLast)
-        UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
+    if (nodestate->nUnconnectingHeaders > 0)
+        LogPrint("net", "peer=%d: resetting nUnconnectingHeaders (%d -> 0)\n", pfrom->id, nodestate->nUnconnectingHeaders);
+    nodestate->nUnconnectingHeaders = 0;
+
+    if (pindexLast == NULL)
+        return true;
+
+    UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
 
-    if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
+    if (nCount == MAX_HEADERS_RESULTS) {
         // Headers message had its maximum size; the peer may have more headers.
         // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
         // from there instead.
@@ -6435,14 +7575,13 @@ bool ProcessMessageHeaders(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
     bool fCanDirectFetch = CanDirectFetch();
-    CNodeState* nodestate = State(pfrom->GetId());
     // If this set of headers is valid and ends in a block with at least as
     // much work as our tip, download as much as possible.
     if (fCanDirectFetch && pindexLast->IsValid(BLOCK_VALID_TREE) && chainActive.Tip()->nChainWork <= pindexLast->nChainWork) {
         vector<CBlockIndex*> vToFetch;
         CBlockIndex* pindexWalk = pindexLast;
         // Calculate all the blocks we'd need to switch to pindexLast, up to a limit.
-        while (pindexWalk && !chainActive.Contains(pindexWalk) && vToFetch.size() <= MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        while (pindexWalk && !chainActive.Contains(pindexWalk) && vToFetch.size() <= (size_t)GetBlocksInTransitLimit(nodestate)) {
             if (!(pindexWalk->nStatus & BLOCK_HAVE_DATA) &&
                 !mapBlocksInFlight.count(pindexWalk->GetBlockHash())) {
                 // We don't have this block, and it's not yet in flight.
@@ -6462,7 +7601,7 @@ bool ProcessMessageHeaders(CNode* pfrom, string strCommand, CDataStream& vRecv,
             vector<CInv> vGetData;
             // Download as much as possible, from earliest to latest.
             BOOST_REVERSE_FOREACH (CBlockIndex* pindex, vToFetch) {
-                if (nodestate->nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                if (nodestate->nBlocksInFlight >= GetBlocksInTransitLimit(nodestate)) {
                     // Can't download any more from this peer
                     break;
                 }
@@ -6475,6 +7614,11 @@ bool ProcessMessageHeaders(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 LogPrint("net", "Downloading blocks toward %s (%d) via headers direct fetch\n",
                     pindexLast->GetBlockHash().ToString(), pindexLast->nHeight);
             }
+            if (vGetData.size() == 1 && nodestate->fProvidesHeaderAndIDs && pindexLast->pprev &&
+                pindexLast->pprev->IsValid(BLOCK_VALID_CHAIN)) {
+                // A single new block on top of our chain: let the peer send it compactly
+                vGetData[0] = CInv(MSG_CMPCT_BLOCK, vGetData[0].hash);
+            }
             if (vGetData.size() > 0) {
                 pfrom->PushMessage(NetMsgType::GETDATA, vGetData);
             }
@@ -6486,7 +7630,7 @@ bool ProcessMessageHeaders(CNode* pfrom, string strCommand, CDataStream& vRecv,
     return true;
 }
 
-bool static ProcessMessageGetHeaders(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+bool static ProcessMessageGetHeaders(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     CBlockLocator locator;
     uint256 hashStop;
@@ -6533,7 +7677,7 @@ bool static ProcessMessageGetHeaders(CNode* pfrom, string strCommand, CDataStrea
     return true;
 }
 
-bool static ProcessMessageAddress(CNode* pfrom, CDataStream& vRecv)
+bool static ProcessMessageAddress(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     vector<CAddress> vAddr;
     vRecv >> vAddr;
@@ -6598,7 +7742,7 @@ bool static ProcessMessageAddress(CNode* pfrom, CDataStream& vRecv)
     return true;
 }
 
-bool static ProcessMessageVerAck(CNode* pfrom)
+bool static ProcessMessageVerAck(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
 
@@ -6616,10 +7760,14 @@ bool static ProcessMessageVerAck(CNode* pfrom)
         pfrom->PushMessage(NetMsgType::SENDHEADERS);
     }
 
+    // Tell our peer we can serve compact blocks, but don't want them announced
+    // that way yet. Peers that don't know the message ignore it.
+    pfrom->PushMessage(NetMsgType::SENDCMPCT, false, CMPCTBLOCKS_VERSION);
+
     return true;
 }
 
-bool static ProcessMessageGetData(CNode* pfrom, CDataStream& vRecv)
+bool static ProcessMessageGetData(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     vector<CInv> vInv;
     vRecv >> vInv;
@@ -6642,7 +7790,108 @@ bool static ProcessMessageGetData(CNode* pfrom, CDataStream& vRecv)
     return true;
 }
 
-bool static ProcessMessageTx(CNode* pfrom, string strCommand, CDataStream& vRecv)
+namespace
+{
+/** A transaction received from a peer, queued for pre-validation */
+struct CTxPreValidationJob {
+    CNode* pfrom; //! referenced while queued
+    std::string strCommand;
+    CTransactionRef ptx;
+};
+
+/** Work queue of ThreadTxPreValidation */
+class CTxPreValidationQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<CTxPreValidationJob> queue;
+
+public:
+    //! Queue a transaction, or return false if the queue is full
+    bool Push(CNode* pfrom, const std::string& strCommand, const CTransactionRef& ptx)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (queue.size() >= MAX_TXPREVALIDATION_QUEUE)
+            return false;
+        CTxPreValidationJob job;
+        job.pfrom = pfrom->AddRef();
+        job.strCommand = strCommand;
+        job.ptx = ptx;
+        queue.push_back(job);
+        cond.notify_one();
+        return true;
+    }
+
+    //! Wait for the next transaction; an interruption point
+    void Pop(CTxPreValidationJob& job)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.empty())
+            cond.wait(lock);
+        job = queue.front();
+        queue.pop_front();
+    }
+};
+
+CTxPreValidationQueue txPreValidationQueue;
+} // anon namespace
+
+/**
+ * Run the expensive checks of a transaction received from a peer without
+ * holding cs_main: the context-free checks, and script verification against
+ * a snapshot of its inputs taken under a short lock. Valid signatures are
+ * stored in the signature cache, so the CheckInputs calls that
+ * AcceptToMemoryPool makes under cs_main only look them up. Nothing else is
+ * kept: acceptance repeats every check against the chain state it sees.
+ */
+void static PreValidateTransaction(const CTransaction& tx)
+{
+    CValidationState state;
+    if (tx.IsCoinBase() || tx.IsCoinStake() || !CheckTransaction(tx, state))
+        return;
+
+    std::vector<CCoins> vCoins;
+    vCoins.reserve(tx.vin.size());
+    {
+        LOCK2(cs_main, mempool.cs);
+        if (AlreadyHave(CInv(MSG_TX, tx.GetHash())))
+            return;
+        CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+        BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+            CCoins coins;
+            if (!viewMemPool.GetCoins(txin.prevout.hash, coins) || !coins.IsAvailable(txin.prevout.n))
+                return;
+            vCoins.push_back(coins);
+        }
+    }
+
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        CScriptCheck check(vCoins[i], tx, i, STANDARD_SCRIPT_VERIFY_FLAGS, true);
+        if (!check())
+            return;
+    }
+}
+
+void static AcceptTransactionFromPeer(CNode* pfrom, const string& strCommand, const CTransaction& tx);
+
+void ThreadTxPreValidation()
+{
+    RenameThread("kore-txcheck");
+    while (true) {
+        CTxPreValidationJob job;
+        txPreValidationQueue.Pop(job);
+        try {
+            PreValidateTransaction(*job.ptx);
+            AcceptTransactionFromPeer(job.pfrom, job.strCommand, *job.ptx);
+        } catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadTxPreValidation()");
+        }
+        job.pfrom->Release();
+    }
+}
+
+bool static ProcessMessageTx(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     // Stop processing the transaction early if
     // We are in blocks only mode and peer is either not whitelisted or whitelistrelay is off
@@ -6651,30 +7900,40 @@ bool static ProcessMessageTx(CNode* pfrom, string strCommand, CDataStream& vRecv
         return true;
     }
 
-    vector<uint256> vWorkQueue;
-    vector<uint256> vEraseQueue;
     CTransaction tx;
-    CTxIn vin;
-    vector<unsigned char> vchSig;
-    int64_t sigTime;
-
     vRecv >> tx;
 
     CInv inv(MSG_TX, tx.GetHash());
     pfrom->AddInventoryKnown(inv);
 
+    // Hand the transaction to the pre-validation threads, they finish it off
+    if (nTxPreValidationThreads && txPreValidationQueue.Push(pfrom, strCommand, MakeTransactionRef(tx)))
+        return true;
+
+    AcceptTransactionFromPeer(pfrom, strCommand, tx);
+    return true;
+}
+
+/** Try to add a transaction received from a peer to the mempool, along with the orphans it unlocks */
+void static AcceptTransactionFromPeer(CNode* pfrom, const string& strCommand, const CTransaction& tx)
+{
+    vector<COutPoint> vWorkQueue;
+    set<uint256> setEraseQueue;
+    CInv inv(MSG_TX, tx.GetHash());
+
     LOCK(cs_main);
 
     bool fMissingInputs = false;
     CValidationState state;
 
     pfrom->setAskFor.erase(inv.hash);
-    mapAlreadyAskedFor.erase(inv.hash);
+    mapAlreadyAskedFor.Erase(inv.hash);
 
     if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs)) {
         mempool.check(pcoinsTip);
         RelayTransaction(tx);
-        vWorkQueue.push_back(inv.hash);
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+            vWorkQueue.push_back(COutPoint(inv.hash, i));
 
         LogPrint("mempool", "AcceptToMemoryPool: peer=%d: accepted %s (poolsz %u txn, %u kB)\n",
             pfrom->id,
@@ -6684,15 +7943,16 @@ bool static ProcessMessageTx(CNode* pfrom, string strCommand, CDataStream& vRecv
         // Recursively process any orphan transactions that depended on this one
         set<NodeId> setMisbehaving;
         for (unsigned int i = 0; i < vWorkQueue.size(); i++) {
-            map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
+            boost::unordered_map<COutPoint, std::vector<uint256>, COutPointHasher>::const_iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
             if (itByPrev == mapOrphanTransactionsByPrev.end())
                 continue;
-            for (set<uint256>::iterator mi = itByPrev->second.begin();
-                 mi != itByPrev->second.end();
-                 ++mi) {
-                const uint256& orphanHash = *mi;
-                const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
+            BOOST_FOREACH (const uint256& orphanHash, itByPrev->second) {
+                // An orphan spending several outputs of the same parent is reached once per output
+                if (setEraseQueue.count(orphanHash))
+                    continue;
+                const COrphanTx& orphan = mapOrphanTransactions.find(orphanHash)->second;
+                const CTransaction& orphanTx = *orphan.tx;
+                NodeId fromPeer = orphan.fromPeer;
                 bool fMissingInputs2 = false;
                 // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
                 // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
@@ -6705,8 +7965,9 @@ bool static ProcessMessageTx(CNode* pfrom, string strCommand, CDataStream& vRecv
                 if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
                     LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
                     RelayTransaction(orphanTx);
-                    vWorkQueue.push_back(orphanHash);
-                    vEraseQueue.push_back(orphanHash);
+                    for (unsigned int j = 0; j < orphanTx.vout.size(); j++)
+                        vWorkQueue.push_back(COutPoint(orphanHash, j));
+                    setEraseQueue.insert(orphanHash);
                 } else if (!fMissingInputs2) {
                     int nDos = 0;
                     if (stateDummy.IsInvalid(nDos) && nDos > 0) {
@@ -6718,7 +7979,7 @@ bool static ProcessMessageTx(CNode* pfrom, string strCommand, CDataStream& vRecv
                     // Has inputs but not accepted to mempool
                     // Probably non-standard or insufficient fee/priority
                     LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                    vEraseQueue.push_back(orphanHash);
+                    setEraseQueue.insert(orphanHash);
                     assert(recentRejects);
                     recentRejects->insert(orphanHash);
                 }
@@ -6726,14 +7987,15 @@ bool static ProcessMessageTx(CNode* pfrom, string strCommand, CDataStream& vRecv
             }
         }
 
-        BOOST_FOREACH (uint256 hash, vEraseQueue)
+        BOOST_FOREACH (const uint256& hash, setEraseQueue)
             EraseOrphanTx(hash);
     } else if (fMissingInputs) {
         AddOrphanTx(tx, pfrom->GetId());
 
         // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
         unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-        unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+        size_t nMaxOrphanBytes = (size_t)std::max((int64_t)0, GetArg("-maxorphantxsize", DEFAULT_MAX_ORPHAN_TX_SIZE)) * 1000;
+        unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx, nMaxOrphanBytes);
         if (nEvicted > 0)
             LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
     } else {
@@ -6772,10 +8034,9 @@ bool static ProcessMessageTx(CNode* pfrom, string strCommand, CDataStream& vRecv
             Misbehaving(pfrom->GetId(), nDoS, state.GetRejectReason());
     }
     FlushStateToDisk(state, FLUSH_STATE_PERIODIC);
-    return true;
 }
 
-bool static ProcessMessageMemPool(CNode* pfrom)
+bool static ProcessMessageMemPool(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     if (CNode::OutboundTargetReached(false) && !pfrom->fWhitelisted) {
         LogPrint("net", "mempool request with bandwidth limit reached, disconnect peer=%d\n", pfrom->GetId());
@@ -6807,7 +8068,7 @@ bool static ProcessMessageMemPool(CNode* pfrom)
     return true;
 }
 
-bool static ProcessMessageVersion(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+bool static ProcessMessageVersion(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     // Each connection can only send one version message
     if (pfrom->nVersion != 0) {
@@ -6925,7 +8186,7 @@ bool static ProcessMessageVersion(CNode* pfrom, string strCommand, CDataStream&
     return true;
 }
 
-bool static ProcessMessageFilterLoad(CNode* pfrom, CDataStream& vRecv)
+bool static ProcessMessageFilterLoad(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     CBloomFilter filter;
     vRecv >> filter;
@@ -6943,7 +8204,7 @@ bool static ProcessMessageFilterLoad(CNode* pfrom, CDataStream& vRecv)
     pfrom->fRelayTxes = true;
 }
 
-bool static ProcessMessageFilterAdd(CNode* pfrom, CDataStream& vRecv)
+bool static ProcessMessageFilterAdd(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     vector<unsigned char> vData;
     vRecv >> vData;
@@ -6961,7 +8222,7 @@ bool static ProcessMessageFilterAdd(CNode* pfrom, CDataStream& vRecv)
     }
 }
 
-bool static ProcessMessageFilterClear(CNode* pfrom, CDataStream& vRecv)
+bool static ProcessMessageFilterClear(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     LOCK(pfrom->cs_filter);
     delete pfrom->pfilter;
@@ -6969,7 +8230,7 @@ bool static ProcessMessageFilterClear(CNode* pfrom, CDataStream& vRecv)
     pfrom->fRelayTxes = true;
 }
 
-bool static ProcessMessageInventory(CNode* pfrom, CDataStream& vRecv)
+bool static ProcessMessageInventory(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     vector<CInv> vInv;
     vRecv >> vInv;
@@ -7012,7 +8273,7 @@ bool static ProcessMessageInventory(CNode* pfrom, CDataStream& vRecv)
                 pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), inv.hash);
                 CNodeState* nodestate = State(pfrom->GetId());
                 if (CanDirectFetch() &&
-                    nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                    nodestate->nBlocksInFlight < GetBlocksInTransitLimit(nodestate)) {
                     vToFetch.push_back(inv);
                     // Mark block as in flight already, even though the actual "getdata" message only goes out
                     // later (within the same cs_main lock, though).
@@ -7047,7 +8308,7 @@ bool static ProcessMessageInventory(CNode* pfrom, CDataStream& vRecv)
  * Making users (which are behind NAT and can only make outgoing connections) ignore
  * getaddr message mitigates the attack.
  */
-bool static ProcessMessageGetAddr(CNode* pfrom)
+bool static ProcessMessageGetAddr(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     if (!pfrom->fInbound) {
         LogPrint("net", "Ignoring \"getaddr\" from outbound connection. peer=%d\n", pfrom->id);
@@ -7061,7 +8322,71 @@ bool static ProcessMessageGetAddr(CNode* pfrom)
     return true;
 }
 
-bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+bool static ProcessMessageSendHeaders(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    LOCK(cs_main);
+    State(pfrom->GetId())->fPreferHeaders = true;
+    return true;
+}
+
+typedef bool (*NetMsgHandlerFunc)(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived);
+
+struct CNetMsgHandler {
+    NetMsgHandlerFunc handler;
+    //! Whether the message carries blocks or headers, which are ignored while importing
+    bool fBlockData;
+};
+
+typedef boost::unordered_map<string, CNetMsgHandler> NetMsgHandlerMap;
+
+static NetMsgHandlerMap CreateNetMsgHandlers()
+{
+    NetMsgHandlerMap mapHandlers;
+    const struct {
+        const char* pszCommand;
+        NetMsgHandlerFunc handler;
+        bool fBlockData;
+    } handlers[] = {
+        {NetMsgType::VERSION, ProcessMessageVersion, false},
+        {NetMsgType::VERACK, ProcessMessageVerAck, false},
+        {NetMsgType::ADDR, ProcessMessageAddress, false},
+        {NetMsgType::SENDHEADERS, ProcessMessageSendHeaders, false},
+        {NetMsgType::INV, ProcessMessageInventory, false},
+        {NetMsgType::GETDATA, ProcessMessageGetData, false},
+        {NetMsgType::GETBLOCKS, ProcessMessageGetBlocks, false},
+        {NetMsgType::GETHEADERS, ProcessMessageGetHeaders, false},
+        {NetMsgType::TX, ProcessMessageTx, false},
+        {NetMsgType::HEADERS, ProcessMessageHeaders, true},
+        {NetMsgType::BLOCK, ProcessMessageBlock, true},
+        {NetMsgType::SENDCMPCT, ProcessMessageSendCmpct, false},
+        {NetMsgType::CMPCTBLOCK, ProcessMessageCmpctBlock, true},
+        {NetMsgType::GETBLOCKTXN, ProcessMessageGetBlockTxn, false},
+        {NetMsgType::BLOCKTXN, ProcessMessageBlockTxn, true},
+        {NetMsgType::GETADDR, ProcessMessageGetAddr, false},
+        {NetMsgType::MEMPOOL, ProcessMessageMemPool, false},
+        {NetMsgType::PING, ProcessMessagePing, false},
+        {NetMsgType::PONG, ProcessMessagePong, false},
+        {NetMsgType::FILTERLOAD, ProcessMessageFilterLoad, false},
+        {NetMsgType::FILTERADD, ProcessMessageFilterAdd, false},
+        {NetMsgType::FILTERCLEAR, ProcessMessageFilterClear, false},
+        {NetMsgType::REJECT, ProcessMessageReject, false},
+    };
+    for (size_t i = 0; i < sizeof(handlers) / sizeof(handlers[0]); i++) {
+        CNetMsgHandler handler = {handlers[i].handler, handlers[i].fBlockData};
+        mapHandlers[handlers[i].pszCommand] = handler;
+    }
+    return mapHandlers;
+}
+
+/** The handler of the messages with command strCommand, or NULL if we don't know it */
+static const CNetMsgHandler* GetNetMsgHandler(const string& strCommand)
+{
+    static const NetMsgHandlerMap mapHandlers = CreateNetMsgHandlers();
+    NetMsgHandlerMap::const_iterator it = mapHandlers.find(strCommand);
+    return it == mapHandlers.end() ? NULL : &it->second;
+}
+
+bool static ProcessMessage(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     RandAddSeedPerfmon();
 
@@ -7086,80 +8411,26 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
     }
 
-    if (strCommand == NetMsgType::VERSION)
-        return ProcessMessageVersion(pfrom, strCommand, vRecv, nTimeReceived);
-
-    else if (pfrom->nVersion == 0) {
-        // Must have a version message before anything else
-        LOCK(cs_main);
-        Misbehaving(pfrom->GetId(), 1, "Didn't send a version first");
-        return false;
-    }
-
-     else if (pfrom->clientVersion < MIM_CLIENT_VERSION) {
-        pfrom->PushMessage(NetMsgType::REJECT, strCommand, REJECT_OBSOLETE, strprintf("Version must be %d or greater", MIM_CLIENT_VERSION));
-        Misbehaving(pfrom->GetId(), 100, "Ban due to fork");
-        pfrom->fDisconnect = true;
-        return false;
-    }
-
-    else if (strCommand == NetMsgType::VERACK)
-        return ProcessMessageVerAck(pfrom);
-
-    else if (strCommand == NetMsgType::ADDR)
-        return ProcessMessageAddress(pfrom, vRecv);
-
-    else if (strCommand == NetMsgType::SENDHEADERS) {
-        LOCK(cs_main);
-        State(pfrom->GetId())->fPreferHeaders = true;
+    if (strCommand != NetMsgType::VERSION) {
+        if (pfrom->nVersion == 0) {
+            // Must have a version message before anything else
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), 1, "Didn't send a version first");
+            return false;
+        } else if (pfrom->clientVersion < MIM_CLIENT_VERSION) {
+            pfrom->PushMessage(NetMsgType::REJECT, strCommand, REJECT_OBSOLETE, strprintf("Version must be %d or greater", MIM_CLIENT_VERSION));
+            Misbehaving(pfrom->GetId(), 100, "Ban due to fork");
+            pfrom->fDisconnect = true;
+            return false;
+        }
     }
 
-    else if (strCommand == NetMsgType::INV)
-        return ProcessMessageInventory(pfrom, vRecv);
-
-    else if (strCommand == NetMsgType::GETDATA)
-        return ProcessMessageGetData(pfrom, vRecv);
-
-    else if (strCommand == NetMsgType::GETBLOCKS)
-        return ProcessMessageGetBlocks(pfrom, strCommand, vRecv, nTimeReceived);
-
-    else if (strCommand == NetMsgType::GETHEADERS)
-        return ProcessMessageGetHeaders(pfrom, strCommand, vRecv, nTimeReceived);
-
-    else if (strCommand == NetMsgType::TX)
-        return ProcessMessageTx(pfrom, strCommand, vRecv);
-
-    else if (strCommand == NetMsgType::HEADERS && !fImporting && !fReindex) // Ignore headers received while importing
-        return ProcessMessageHeaders(pfrom, strCommand, vRecv, nTimeReceived);
-
-    else if (strCommand == NetMsgType::BLOCK && !fImporting && !fReindex) // Ignore blocks received while importing
-        return ProcessMessageBlock(pfrom, strCommand, vRecv);
-
-    else if (strCommand == NetMsgType::GETADDR)
-        return ProcessMessageGetAddr(pfrom);
-
-    else if (strCommand == NetMsgType::MEMPOOL)
-        return ProcessMessageMemPool(pfrom);
-
-    else if (strCommand == NetMsgType::PING)
-        return ProcessMessagePing(pfrom, strCommand, vRecv, nTimeReceived);
-
-    else if (strCommand == NetMsgType::PONG)
-        return ProcessMessagePong(pfrom, strCommand, vRecv, nTimeReceived);
-
-    else if (strCommand == NetMsgType::FILTERLOAD)
-        return ProcessMessageFilterLoad(pfrom, vRecv);
-
-    else if (strCommand == NetMsgType::FILTERADD)
-        return ProcessMessageFilterAdd(pfrom, vRecv);
-
-    else if (strCommand == NetMsgType::FILTERCLEAR)
-        return ProcessMessageFilterClear(pfrom, vRecv);
-
-    else if (strCommand == NetMsgType::REJECT)
-        return ProcessMessageReject(pfrom, strCommand, vRecv, nTimeReceived);
-
-    return true;
+    const CNetMsgHandler* phandler = GetNetMsgHandler(strCommand);
+    if (phandler == NULL)
+        return true;
+    if (phandler->fBlockData && (fImporting || fReindex)) // Ignore blocks received while importing
+        return true;
+    return phandler->handler(pfrom, strCommand, vRecv, nTimeReceived);
 }
 
 int ActiveProtocol()
@@ -7237,6 +8508,8 @@ bool ProcessMessages(CNode* pfrom)
 
         // Process message
         bool fRet = false;
+        int64_t nProcessStart = GetTimeMicros();
+        int64_t nLockTimeStart = GetLockHoldTime();
         try {
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
 
@@ -7257,6 +8530,9 @@ bool ProcessMessages(CNode* pfrom)
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
 
+        pfrom->RecordRecvMsg(GetNetMsgHandler(strCommand) ? strCommand : NET_MESSAGE_COMMAND_OTHER, nMessageSize + CMessageHeader::HEADER_SIZE,
+            GetTimeMicros() - nProcessStart, GetLockHoldTime() - nLockTimeStart);
+
         if (!fRet && fDebug)
             LogPrintf("ProcessMessage(%s, %u bytes) FAILED peer=%d\n", SanitizeString(strCommand), nMessageSize, pfrom->id);
 
@@ -7264,8 +8540,11 @@ bool ProcessMessages(CNode* pfrom)
     }
 
     // In case the connection got shut down, its receive buffer was wiped
-    if (!pfrom->fDisconnect)
+    if (!pfrom->fDisconnect) {
+        for (std::deque<CNetMessage>::iterator itDone = pfrom->vRecvMsg.begin(); itDone != it; itDone++)
+            pfrom->RecycleRecvBuffer(*itDone);
         pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+    }
 
     return fOk;
 }
@@ -7415,7 +8694,8 @@ bool SendMessages(CNode* pto)
         // add all to the inv queue.
         LOCK(pto->cs_inventory);
         vector<CBlock> vHeaders;
-        bool fRevertToInv = (!state.fPreferHeaders || pto->vBlockHashesToAnnounce.size() > MAX_BLOCKS_TO_ANNOUNCE_LEGACY);
+        bool fRevertToInv = ((!state.fPreferHeaders && (!state.fPreferHeaderAndIDs || pto->vBlockHashesToAnnounce.size() > 1)) ||
+                             pto->vBlockHashesToAnnounce.size() > MAX_BLOCKS_TO_ANNOUNCE_LEGACY);
         CBlockIndex* pBestIndex = NULL;    // last header queued for delivery
         ProcessBlockAvailability(pto->id); // ensure pindexBestKnownBlock is up-to-date
 
@@ -7487,13 +8767,24 @@ bool SendMessages(CNode* pto)
 
                 // If the peer announced this block to us, don't inv it back.
                 // (Since block announcements may not be via inv's, we can't solely rely on
-                // setInventoryKnown to track this.)
+                // filterInventoryKnown to track this.)
                 if (!PeerHasHeader_Legacy(&state, pindex)) {
                     pto->PushInventory(CInv(MSG_BLOCK, hashToAnnounce));
                     LogPrint("net", "%s: sending inv peer=%d hash=%s\n", __func__,
                         pto->id, hashToAnnounce.ToString());
                 }
             }
+        } else if (vHeaders.size() == 1 && state.fPreferHeaderAndIDs) {
+            // Only a single new block is announced with a cmpctblock, more
+            // than that means the peer is syncing or slow
+            LogPrint("net", "%s: sending header-and-ids %s to peer=%d\n", __func__,
+                vHeaders.front().GetHash().ToString(), pto->id);
+            boost::shared_ptr<const CBlock> pblock;
+            if (!ReadBlockFromDisk(pblock, pBestIndex))
+                assert(!"cannot load block from disk");
+            CBlockHeaderAndShortTxIDs cmpctblock(*pblock);
+            pto->PushMessage(NetMsgType::CMPCTBLOCK, cmpctblock);
+            state.pindexBestHeaderSent_Legacy = pBestIndex;
         } else if (!vHeaders.empty()) {
             if (vHeaders.size() > 1) {
                 LogPrint("net", "%s: %u headers, range (%s, %s), to peer=%d\n", __func__,
@@ -7587,19 +8878,32 @@ bool SendMessages(CNode* pto)
     // Message: getdata (blocks)
     //
     vector<CInv> vGetData;
-    if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+    int nBlocksInTransitLimit = GetBlocksInTransitLimit(&state);
+    if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < nBlocksInTransitLimit) {
         vector<CBlockIndex*> vToDownload;
         NodeId staller = -1;
-        FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+        FindNextBlocksToDownload(pto->GetId(), nBlocksInTransitLimit - state.nBlocksInFlight, vToDownload, staller);
         BOOST_FOREACH (CBlockIndex* pindex, vToDownload) {
             vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
             MarkBlockAsInFlight_Legacy(pto->GetId(), pindex->GetBlockHash(), pindex);
             LogPrint("net", "Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                 pindex->nHeight, pto->id);
         }
-        if (state.nBlocksInFlight == 0 && staller != -1) {
-            if (State(staller)->nStallingSince == 0) {
-                State(staller)->nStallingSince = nNow;
+        if (vToDownload.empty() && staller != -1) {
+            CNodeState* stallerState = State(staller);
+            // The block that holds back the window is the first one after the last block we have in common
+            // with this peer. Ask for it here instead if this peer delivers faster than the staller, so a
+            // slow peer delays the download by no more than one of its blocks, without being disconnected.
+            CBlockIndex* pindexStalled = state.pindexBestKnownBlock->GetAncestor(state.pindexLastCommonBlock->nHeight + 1);
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(pindexStalled->GetBlockHash());
+            if (state.nAvgBlockTime != 0 && (stallerState->nAvgBlockTime == 0 || state.nAvgBlockTime < stallerState->nAvgBlockTime) &&
+                itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == staller) {
+                vGetData.push_back(CInv(MSG_BLOCK, pindexStalled->GetBlockHash()));
+                MarkBlockAsInFlight_Legacy(pto->GetId(), pindexStalled->GetBlockHash(), pindexStalled);
+                LogPrint("net", "Requesting block %s (%d) stalled by peer=%d from peer=%d\n", pindexStalled->GetBlockHash().ToString(),
+                    pindexStalled->nHeight, staller, pto->id);
+            } else if (state.nBlocksInFlight == 0 && stallerState->nStallingSince == 0) {
+                stallerState->nStallingSince = nNow;
                 LogPrint("net", "Stall started peer=%d\n", staller);
             }
         }
@@ -7660,16 +8964,20 @@ bool CBlockUndo::WriteToDisk(CDiskBlockPos& pos, const uint256& hashBlock)
 
 bool CBlockUndo::ReadFromDisk(const CDiskBlockPos& pos, const uint256& hashBlock)
 {
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("CBlockUndo::ReadFromDisk : OpenBlockFile failed");
-
-    // Read block
+    // Read undo data and its checksum, straight from the mapped file when possible
     uint256 hashChecksum;
+    CBlockFileReader mapped(SER_DISK, CLIENT_VERSION);
     try {
-        filein >> *this;
-        filein >> hashChecksum;
+        if (blockFileCache.Open(pos, "rev", sizeof(hashChecksum), mapped)) {
+            mapped >> *this;
+            mapped >> hashChecksum;
+        } else {
+            CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("CBlockUndo::ReadFromDisk : OpenBlockFile failed");
+            filein >> *this;
+            filein >> hashChecksum;
+        }
     } catch (std::exception& e) {
         return error("%s : Deserialize or I/O error - %s", __func__, e.what());
     }
@@ -7697,13 +9005,12 @@ public:
     ~CMainCleanup()
     {
         // block headers
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        blockIndexArena.Clear();
 
         // orphan transactions
         mapOrphanTransactions.clear();
         mapOrphanTransactionsByPrev.clear();
+        mapOrphanPeers.clear();
     }
 } instance_of_cmaincleanup;
@@ -43,11 +43,14 @@
 #include <vector>
 
 
+#include <boost/shared_ptr.hpp>
 #include <boost/unordered_map.hpp>
 
 class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
+class CCoinsSnapshotMetadata;
+class CCoinsViewDB;
 class CInv;
 class CScriptCheck;
 class CValidationInterface;
@@ -79,6 +82,14 @@ static const unsigned int MAX_TX_SIGOPS_LEGACY = MAX_BLOCK_SIGOPS_LEGACY / 5;
 static const unsigned int MAX_STANDARD_TX_SIGOPS_LEGACY = MAX_BLOCK_SIGOPS_LEGACY / 5;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxorphantxsize, maximum kilobytes of orphan transactions kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_TX_SIZE = 500;
+/** Largest transaction accepted into the orphan pool, in bytes */
+static const unsigned int MAX_ORPHAN_TX_BYTES = 5000;
+/** Seconds after which an orphan transaction is dropped from the orphan pool */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum seconds between two sweeps of expired orphan transactions */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
 /** Default for -limitancestorcount, max number of in-mempool ancestors */
 static const unsigned int DEFAULT_ANCESTOR_LIMIT_LEGACY = 25;
 /** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
@@ -89,6 +100,8 @@ static const unsigned int DEFAULT_DESCENDANT_LIMIT_LEGACY = 25;
 static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT_LEGACY = 101;
 /** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
 static const unsigned int DEFAULT_MEMPOOL_EXPIRY_LEGACY = 72;
+/** Default for -persistmempool, save the mempool on shutdown and reload it on startup */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
 
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
@@ -98,12 +111,27 @@ static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 /** Coinbase transaction outputs can only be spent after this number of new blocks (network rule) */
 //static const int COINBASE_MATURITY = 25;
+/** Maximum number of threads checking blocks during -reindex and -loadblock imports */
+static const int MAX_BLOCK_IMPORT_THREADS = 16;
+/** Maximum bytes of read but not yet connected blocks buffered by the block import pipeline */
+static const uint64_t MAX_BLOCK_IMPORT_BYTES_IN_FLIGHT = 64 << 20;
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
+/** Maximum number of threads pre-validating transactions received from peers */
+static const int MAX_TXPREVALIDATION_THREADS = 16;
+/** -txprevalidation default (number of transaction pre-validation threads, 0 = auto) */
+static const int DEFAULT_TXPREVALIDATION_THREADS = 0;
+/** Maximum number of received transactions waiting for pre-validation before they are processed inline */
+static const unsigned int MAX_TXPREVALIDATION_QUEUE = 1000;
+/** Number of blocks that can be requested at any given time from a peer whose download pace is not known yet. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Fewest and most blocks requested at any given time from a single peer, depending on its measured pace. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER = 64;
+/** Time in seconds it should take a peer, at its measured pace, to deliver the blocks we keep requested from it. */
+static const int64_t BLOCK_DOWNLOAD_QUEUE_TIME = 4;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -152,6 +180,16 @@ static const bool DEFAULT_ADDRINDEX = true;
 static const bool DEFAULT_ENABLE_REPLACEMENT = true; // Legacy
 /** Maximum number of headers to announce when relaying blocks with headers message.*/
 static const unsigned int MAX_BLOCKS_TO_ANNOUNCE_LEGACY = 8;
+/** Maximum number of unconnecting headers announcements before DoS score */
+static const int MAX_UNCONNECTING_HEADERS = 10;
+/** Version of the compact block encoding announced in sendcmpct messages */
+static const uint64_t CMPCTBLOCKS_VERSION = 1;
+/** Maximum depth below the tip at which blocks are served as cmpctblock in response to getdata */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Maximum depth below the tip at which getblocktxn requests are answered */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Number of peers asked to announce new blocks directly with a cmpctblock (high-bandwidth mode) */
+static const unsigned int MAX_CMPCTBLOCK_HB_PEERS = 3;
 
 static const unsigned int DEFAULT_LIMITFREERELAY_LEGACY = 15;
 static const bool DEFAULT_RELAYPRIORITY_LEGACY = true;
@@ -182,13 +220,20 @@ extern std::mutex csBestBlock;
 extern std::condition_variable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
+/** Rebuild the chainstate from the existing block index and block files (-reindex-chainstate) */
+extern bool fReindexChainState;
+/** Whether LoadMempool() ran to completion, i.e. mempool.dat may be overwritten */
+extern bool fMempoolLoaded;
 extern int nScriptCheckThreads;
+extern int nTxPreValidationThreads;
 extern bool fTxIndex;
 extern bool fAddrIndex;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
 extern unsigned int nBytesPerSigOp;
 extern bool fCheckBlockIndex;
+/** Block hash whose ancestors are assumed to have valid scripts (-assumevalid), 0 to verify everything */
+extern uint256 hashAssumeValid;
 extern unsigned int nCoinCacheSize;
 extern size_t nCoinCacheUsage;
 extern CFeeRate minRelayTxFee;
@@ -263,9 +308,10 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals);
  * @param[in]   pfrom   The node which we are receiving the block from; it is added to mapBlockSource and may be penalised if the block is invalid.
  * @param[in]   pblock  The block we want to process.
  * @param[out]  dbp     If pblock is stored to disk (or already there), this will be set to its location.
+ * @param[in]   fAlreadyChecked  CheckBlock and the block signature were already verified by the caller.
  * @return True if state.IsValid()
  */
-bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp = NULL);
+bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp = NULL, bool fAlreadyChecked = false);
 
 /** 
  * Process an incoming block. This only returns after the best known valid
@@ -290,6 +336,20 @@ FILE* OpenUndoFile(const CDiskBlockPos& pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos& pos, const char* prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp = NULL);
+/** Write the active chain's block index and UTXO set to a snapshot file (requires cs_main and a flushed chainstate) */
+bool DumpUTXOSnapshot(CAutoFile& fileout, CCoinsSnapshotMetadata& metadata);
+/** Bulk-load a snapshot written by DumpUTXOSnapshot into an empty block tree and coins database */
+bool LoadUTXOSnapshot(CAutoFile& filein, CCoinsViewDB* pcoinsview, CCoinsSnapshotMetadata& metadata);
+/**
+ * Write mapBlockIndex to a flat snapshot that the next LoadBlockIndex() reads
+ * instead of decoding the block tree database. Only valid on a flushed index,
+ * i.e. at clean shutdown (requires cs_main).
+ */
+bool WriteBlockIndexSnapshot();
+/** Write the mempool, with entry times and prioritisation deltas, to mempool.dat */
+bool DumpMempool();
+/** Re-add the transactions saved by DumpMempool() to the mempool, a batch per cs_main acquisition */
+bool LoadMempool();
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
@@ -309,6 +369,8 @@ bool SendMessages(CNode* pto);
 
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the thread pre-validating transactions received from peers */
+void ThreadTxPreValidation();
 
 int GetBestPeerHeight();
 
@@ -367,8 +429,8 @@ void FlushStateToDisk();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
 
-/** (try to) add transaction to memory pool **/
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fOverrideMempoolLimit = false, bool fRejectAbsurdFee = false, bool ignoreFees = false, bool isLoadingTx = false);
+/** (try to) add transaction to memory pool, recording nAcceptTime (default: now) as its entry time **/
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fOverrideMempoolLimit = false, bool fRejectAbsurdFee = false, bool ignoreFees = false, bool isLoadingTx = false, int64_t nAcceptTime = 0);
 
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool isDSTX = false);
 
@@ -380,6 +442,8 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int nBlocksInTransitLimit;
+    int64_t nAvgBlockTime;
 };
 
 struct CDiskTxPos : public CDiskBlockPos {
@@ -599,8 +663,10 @@ public:
 
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos);
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, bool fCheckPOW = true);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Read a block through the shared block cache, reading it from disk and caching it on a miss */
+bool ReadBlockFromDisk(boost::shared_ptr<const CBlock>& pblock, const CBlockIndex* pindex);
 
 /* This function will return the nHeight from an pIndex, 
   if pIndex is Null it will return the 
@@ -29,7 +29,6 @@
 #include "validationinterface.h"
 
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/program_options/detail/config_file.hpp>
 
@@ -43,53 +42,487 @@ using namespace std;
 //
 // KOREMiner
 //
-//
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
-//
-class COrphan
+
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+
+namespace
 {
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
+/**
+ * A mempool entry whose ancestor state was adjusted for the ancestors that are
+ * already in the block being assembled. Only descendants of transactions in
+ * the block need one; everything else is scored straight from mapTx.
+ */
+struct CTxMemPoolModifiedEntry {
+    explicit CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
+    {
+        iter = entry;
+        nSizeWithAncestors = entry->GetSizeWithAncestors();
+        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
+        nSigOpCountWithAncestors = entry->GetSigOpCountWithAncestors();
+    }
+
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+    unsigned int nSigOpCountWithAncestors;
+};
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+/** Same order as CompareTxMemPoolEntryByAncestorFee, on the adjusted ancestor state */
+struct CompareModifiedEntry {
+    bool operator()(const CTxMemPoolModifiedEntry& a, const CTxMemPoolModifiedEntry& b) const
     {
+        double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
+        double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
+        if (f1 == f2)
+            return CTxMemPool::CompareIteratorByHash()(a.iter, b.iter);
+        return f1 > f2;
     }
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator()(const CTxMemPoolModifiedEntry& entry) const { return entry.iter; }
+};
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        // sorted by mempool entry
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CTxMemPool::CompareIteratorByHash
+        >,
+        // sorted by adjusted fee rate with ancestors
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareModifiedEntry
+        >
+    >
+> indexed_modified_transaction_set;
+
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::nth_index<1>::type::iterator modtxscoreiter;
+
+struct update_for_parent_inclusion {
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
+
+    void operator()(CTxMemPoolModifiedEntry& e)
+    {
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
+        e.nSigOpCountWithAncestors -= iter->GetSigOpCount();
+    }
+
+    CTxMemPool::txiter iter;
+};
+
+/** Orders a package so that parents come before their children */
+struct CompareTxIterByAncestorCount {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
+
+/**
+ * Fills a block template with mempool transactions: first by coin age
+ * priority up to -blockprioritysize, then as packages of a transaction and
+ * its not yet included ancestors, best ancestor fee rate first. The mempool
+ * keeps the ancestor state of every entry up to date, so no coins are looked
+ * up here. Requires cs_main and mempool.cs.
+ */
+class CBlockAssembler
 {
-    bool byFee;
+private:
+    CBlockTemplate* pblocktemplate;
+    CBlock* pblock;
+    const int nHeight;
+    const unsigned int nBlockMaxSize;
+    const unsigned int nBlockMinSize;
+    const unsigned int nBlockPrioritySize;
+    const bool fPrintPriority;
+
+    CTxMemPool::setEntries inBlock;
+
+    void AddToBlock(CTxMemPool::txiter iter)
+    {
+        pblock->vtx.push_back(iter->GetTx());
+        pblocktemplate->vTxFees.push_back(iter->GetFee());
+        pblocktemplate->vTxSigOps.push_back(iter->GetSigOpCount());
+        nBlockSize += iter->GetTxSize();
+        ++nBlockTx;
+        nBlockSigOps += iter->GetSigOpCount();
+        nFees += iter->GetFee();
+        inBlock.insert(iter);
+
+        if (fPrintPriority && fDebug) {
+            double dPriority = iter->GetPriority(nHeight);
+            CAmount dummy;
+            mempool.ApplyDeltas(iter->GetTx().GetHash(), dPriority, dummy);
+            LogPrintf("priority %.1f fee %s txid %s\n", dPriority, CFeeRate(iter->GetModifiedFee(), iter->GetTxSize()).ToString(), iter->GetTx().GetHash().ToString());
+        }
+    }
+
+    bool TestPackage(uint64_t packageSize, unsigned int packageSigOps) const
+    {
+        if (nBlockSize + packageSize >= nBlockMaxSize)
+            return false;
+        if (nBlockSigOps + packageSigOps >= MAX_BLOCK_SIGOPS_CURRENT)
+            return false;
+        return true;
+    }
+
+    /** Whether every transaction of the package may go into this block */
+    bool TestPackageTransactions(const CTxMemPool::setEntries& package) const
+    {
+        BOOST_FOREACH (const CTxMemPool::txiter it, package) {
+            const CTransaction& tx = it->GetTx();
+            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+                return false;
+
+            //Check for invalid/fraudulent inputs. They shouldn't make it through mempool, but check anyways.
+            BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+                if (invalid_out::ContainsOutPoint(txin.prevout)) {
+                    if (fDebug)
+                        LogPrintf("%s : found invalid input %s in tx %s", __func__, txin.prevout.ToString(), tx.GetHash().ToString());
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    /** Whether some in-mempool parent of iter is not in the block yet */
+    bool IsStillDependent(CTxMemPool::txiter iter) const
+    {
+        BOOST_FOREACH (CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter)) {
+            if (!inBlock.count(parent))
+                return true;
+        }
+        return false;
+    }
+
+    /** Add descendants of the given transactions to mapModifiedTx with their
+     *  ancestor state reduced by the transactions now in the block */
+    void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx)
+    {
+        BOOST_FOREACH (const CTxMemPool::txiter it, alreadyAdded) {
+            CTxMemPool::setEntries descendants;
+            mempool.CalculateDescendants(it, descendants);
+            BOOST_FOREACH (CTxMemPool::txiter desc, descendants) {
+                if (alreadyAdded.count(desc))
+                    continue;
+                modtxiter mit = mapModifiedTx.find(desc);
+                if (mit == mapModifiedTx.end()) {
+                    CTxMemPoolModifiedEntry modEntry(desc);
+                    modEntry.nSizeWithAncestors -= it->GetTxSize();
+                    modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
+                    modEntry.nSigOpCountWithAncestors -= it->GetSigOpCount();
+                    mapModifiedTx.insert(modEntry);
+                } else {
+                    mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
+                }
+            }
+        }
+    }
+
+    /** Skip entries of mapTx that are in the block, in mapModifiedTx (scored
+     *  there instead) or that already failed as part of a modified package */
+    bool SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set& mapModifiedTx, CTxMemPool::setEntries& failedTx) const
+    {
+        return mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it);
+    }
 
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) {}
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+
+    CBlockAssembler(CBlockTemplate* pblocktemplateIn, int nHeightIn, unsigned int nBlockMaxSizeIn, unsigned int nBlockMinSizeIn, unsigned int nBlockPrioritySizeIn)
+        : pblocktemplate(pblocktemplateIn), pblock(&pblocktemplateIn->block), nHeight(nHeightIn),
+          nBlockMaxSize(nBlockMaxSizeIn), nBlockMinSize(nBlockMinSizeIn), nBlockPrioritySize(nBlockPrioritySizeIn),
+          fPrintPriority(GetBoolArg("-printpriority", false)),
+          nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0)
+    {
+        // Account for transactions already in the template (coinbase, coinstake)
+        BOOST_FOREACH (const CTransaction& tx, pblock->vtx)
+            nBlockSize += ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    }
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    /** Fill up to nBlockPrioritySize with the transactions of highest coin age priority */
+    void AddPriorityTxs()
     {
-        if (byFee) {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        } else {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+        if (nBlockPrioritySize == 0)
+            return;
+
+        vector<TxCoinAgePriority> vecPriority;
+        TxCoinAgePriorityCompare pricomparer;
+        std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+        typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
+
+        vecPriority.reserve(mempool.mapTx.size());
+        for (CTxMemPool::txiter mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi) {
+            double dPriority = mi->GetPriority(nHeight);
+            CAmount dummy;
+            mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+            vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+        }
+        std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+
+        while (!vecPriority.empty()) {
+            CTxMemPool::txiter iter = vecPriority.front().second;
+            double actualPriority = vecPriority.front().first;
+            std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+            vecPriority.pop_back();
+
+            // Wait for the parents of this transaction to be added
+            if (IsStillDependent(iter)) {
+                waitPriMap.insert(std::make_pair(iter, actualPriority));
+                continue;
+            }
+
+            CTxMemPool::setEntries package;
+            package.insert(iter);
+            if (!TestPackage(iter->GetTxSize(), iter->GetSigOpCount()) || !TestPackageTransactions(package))
+                continue;
+
+            AddToBlock(iter);
+
+            // Done once past the priority size or below the free threshold
+            if (nBlockSize >= nBlockPrioritySize || !AllowFree(actualPriority))
+                return;
+
+            // Transactions that depend on this one may be considered again
+            BOOST_FOREACH (CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter)) {
+                waitPriIter wpiter = waitPriMap.find(child);
+                if (wpiter != waitPriMap.end()) {
+                    vecPriority.push_back(TxCoinAgePriority(wpiter->second, child));
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                    waitPriMap.erase(wpiter);
+                }
+            }
+        }
+    }
+
+    /** Add packages by fee rate with ancestors until the block is full */
+    void AddPackageTxs()
+    {
+        // mapModifiedTx holds the descendants of transactions in the block,
+        // scored on the ancestors that are not in the block yet
+        indexed_modified_transaction_set mapModifiedTx;
+        // Entries of mapModifiedTx whose package did not fit
+        CTxMemPool::setEntries failedTx;
+
+        UpdatePackagesForAdded(inBlock, mapModifiedTx);
+
+        CTxMemPool::indexed_transaction_set::nth_index<4>::type::iterator mi = mempool.mapTx.get<4>().begin();
+        CTxMemPool::txiter iter;
+        while (mi != mempool.mapTx.get<4>().end() || !mapModifiedTx.empty()) {
+            // First try to find a new transaction in mapTx to evaluate.
+            if (mi != mempool.mapTx.get<4>().end() && SkipMapTxEntry(mempool.mapTx.project<0>(mi), mapModifiedTx, failedTx)) {
+                ++mi;
+                continue;
+            }
+
+            // Evaluate the better of the next mapTx entry and the best mapModifiedTx entry
+            bool fUsingModified = false;
+            modtxscoreiter modit = mapModifiedTx.get<1>().begin();
+            if (mi == mempool.mapTx.get<4>().end()) {
+                iter = modit->iter;
+                fUsingModified = true;
+            } else {
+                iter = mempool.mapTx.project<0>(mi);
+                if (modit != mapModifiedTx.get<1>().end() && CompareModifiedEntry()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                    iter = modit->iter;
+                    fUsingModified = true;
+                } else {
+                    ++mi;
+                }
+            }
+
+            // mapModifiedTx never holds anything that is in the block
+            assert(!inBlock.count(iter));
+
+            uint64_t packageSize = iter->GetSizeWithAncestors();
+            CAmount packageFees = iter->GetModFeesWithAncestors();
+            unsigned int packageSigOps = iter->GetSigOpCountWithAncestors();
+            if (fUsingModified) {
+                packageSize = modit->nSizeWithAncestors;
+                packageFees = modit->nModFeesWithAncestors;
+                packageSigOps = modit->nSigOpCountWithAncestors;
+            }
+
+            if (packageFees < ::minRelayTxFee.GetFee(packageSize) && nBlockSize >= nBlockMinSize) {
+                // Everything else we might consider has a lower fee rate
+                return;
+            }
+
+            CTxMemPool::setEntries ancestors;
+            if (TestPackage(packageSize, packageSigOps)) {
+                uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+                std::string dummy;
+                mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+                // Only the ancestors that are not in the block yet are part of the package
+                for (CTxMemPool::setEntries::iterator it = ancestors.begin(); it != ancestors.end();) {
+                    if (inBlock.count(*it))
+                        ancestors.erase(it++);
+                    else
+                        ++it;
+                }
+                ancestors.insert(iter);
+            }
+
+            if (ancestors.empty() || !TestPackageTransactions(ancestors)) {
+                if (fUsingModified) {
+                    // Since we always look at the best entry in mapModifiedTx,
+                    // we must erase failed entries so that we can consider the
+                    // next best entry on the next loop iteration
+                    mapModifiedTx.get<1>().erase(modit);
+                    failedTx.insert(iter);
+                }
+                continue;
+            }
+
+            // Package can be added, parents first
+            std::vector<CTxMemPool::txiter> sortedEntries(ancestors.begin(), ancestors.end());
+            std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
+            BOOST_FOREACH (CTxMemPool::txiter entry, sortedEntries) {
+                AddToBlock(entry);
+                mapModifiedTx.erase(entry);
+            }
+
+            // Update transactions that depend on each of these
+            UpdatePackagesForAdded(ancestors, mapModifiedTx);
         }
     }
 };
 
+/** Block size limits for block assembly, from -blockmaxsize, -blockminsize and -blockprioritysize */
+void GetBlockSizeLimits(unsigned int& nBlockMaxSize, unsigned int& nBlockMinSize, unsigned int& nBlockPrioritySize)
+{
+    // Largest block you're willing to create:
+    nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+
+    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+    unsigned int nBlockMaxSizeNetwork = MAX_BLOCK_SIZE;
+    nBlockMaxSize = std::max((unsigned int)1000, std::min((nBlockMaxSizeNetwork - 1000), nBlockMaxSize));
+
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+
+    // Minimum block size you want to create; block will be filled with free transactions
+    // until there are no more or the block reaches this size:
+    nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+}
+
+/** Bytes kept free in the staking template for the coinbase and coinstake */
+static const unsigned int STAKING_TEMPLATE_RESERVED_SIZE = 2000;
+
+/**
+ * Transaction selection for the next proof-of-stake block, kept up to date by
+ * the staking thread between kernel searches. Once a kernel is found the block
+ * only needs a copy of it next to the coinstake instead of a full assembly pass.
+ * The selection stays valid for as long as the tip it was built on is the tip:
+ * transactions that left the mempool since still spend unspent outputs, and
+ * newer mempool entries are picked up by the next Refresh().
+ */
+class CStakingTemplate
+{
+private:
+    CCriticalSection cs;
+    uint256 hashPrevBlock;
+    unsigned int nTransactionsUpdated;
+    std::vector<CTransaction> vtx;
+    std::vector<CAmount> vTxFees;
+    std::vector<int64_t> vTxSigOps;
+    CAmount nFees;
+    //! Serialized size of the selected transactions
+    uint64_t nTxSize;
+
+public:
+    CStakingTemplate() : nTransactionsUpdated(0), nFees(0), nTxSize(0) {}
+
+    /** Rebuild the selection if the tip or the mempool changed since it was built */
+    void Refresh()
+    {
+        LOCK2(cs_main, mempool.cs);
+        CBlockIndex* pindexPrev = chainActive.Tip();
+        if (!pindexPrev)
+            return;
+
+        LOCK(cs);
+        if (hashPrevBlock == pindexPrev->GetBlockHash() && nTransactionsUpdated == mempool.GetTransactionsUpdated())
+            return;
+
+        unsigned int nBlockMaxSize, nBlockMinSize, nBlockPrioritySize;
+        GetBlockSizeLimits(nBlockMaxSize, nBlockMinSize, nBlockPrioritySize);
+        // Leave room for the coinbase and coinstake that are added later
+        nBlockMaxSize -= std::min(nBlockMaxSize, STAKING_TEMPLATE_RESERVED_SIZE);
+
+        CBlockTemplate scratch(CBlockHeader::POS_FORK_VERSION);
+        CBlockAssembler assembler(&scratch, pindexPrev->nHeight + 1, nBlockMaxSize, nBlockMinSize, nBlockPrioritySize);
+        assembler.AddPriorityTxs();
+        assembler.AddPackageTxs();
+
+        vtx.swap(scratch.block.vtx);
+        vTxFees.swap(scratch.vTxFees);
+        vTxSigOps.swap(scratch.vTxSigOps);
+        nFees = assembler.nFees;
+        nTxSize = assembler.nBlockSize - 1000;
+        hashPrevBlock = pindexPrev->GetBlockHash();
+        nTransactionsUpdated = mempool.GetTransactionsUpdated();
+    }
+
+    /**
+     * Append the selection to a template that holds the coinbase and coinstake
+     * of a block on top of pindexPrev. Fails if the selection was built on
+     * another tip or does not fit next to the transactions already there.
+     */
+    bool CopyTo(const CBlockIndex* pindexPrev, CBlockTemplate* pblocktemplate, unsigned int nBlockMaxSize, CAmount& nFeesOut)
+    {
+        LOCK(cs);
+        if (hashPrevBlock.IsNull() || hashPrevBlock != pindexPrev->GetBlockHash())
+            return false;
+
+        CBlock* pblock = &pblocktemplate->block;
+        uint64_t nBlockSize = 1000 + nTxSize;
+        BOOST_FOREACH (const CTransaction& tx, pblock->vtx)
+            nBlockSize += ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        if (nBlockSize >= nBlockMaxSize)
+            return false;
+
+        pblock->vtx.insert(pblock->vtx.end(), vtx.begin(), vtx.end());
+        pblocktemplate->vTxFees.insert(pblocktemplate->vTxFees.end(), vTxFees.begin(), vTxFees.end());
+        pblocktemplate->vTxSigOps.insert(pblocktemplate->vTxSigOps.end(), vTxSigOps.begin(), vTxSigOps.end());
+        nFeesOut = nFees;
+        nLastBlockTx = vtx.size();
+        nLastBlockSize = nBlockSize;
+        return true;
+    }
+
+    /** Forget the selection, e.g. after a block built from it failed validation */
+    void Clear()
+    {
+        LOCK(cs);
+        hashPrevBlock.SetNull();
+        vtx.clear();
+        vTxFees.clear();
+        vTxSigOps.clear();
+        nFees = 0;
+        nTxSize = 0;
+    }
+};
+
+CStakingTemplate stakingTemplate;
+} // anon namespace
+
 class ScoreCompare //Legacy class
 {
 public:
@@ -295,22 +728,8 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
     } else 
         pblock->nTime = GetAdjustedTime();
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-
-    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    unsigned int nBlockMaxSizeNetwork = MAX_BLOCK_SIZE;
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((nBlockMaxSizeNetwork - 1000), nBlockMaxSize));
-
-    // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
-
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+    unsigned int nBlockMaxSize, nBlockMinSize, nBlockPrioritySize;
+    GetBlockSizeLimits(nBlockMaxSize, nBlockMinSize, nBlockPrioritySize);
 
     // Collect memory pool transactions into the block
     CAmount nFees = 0;
@@ -320,182 +739,18 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
 
         CBlockIndex* pindexPrev = chainActive.Tip();
         const int nHeight = pindexPrev->nHeight + 1;
-        CCoinsViewCache view(pcoinsTip);
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi) {
-            const CTransaction& tx = mi->GetTx();
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight)) {
-                continue;
-            }
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            uint256 txid = tx.GetHash();
-            for (const CTxIn& txin : tx.vin) {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash)) {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash)) {
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan) {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx.find(txin.prevout.hash)->GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-
-                //Check for invalid/fraudulent inputs. They shouldn't make it through mempool, but check anyways.
-                if (invalid_out::ContainsOutPoint(txin.prevout)) {
-                    if (fDebug)
-                        LogPrintf("%s : found invalid input %s in tx %s", __func__, txin.prevout.ToString(), tx.GetHash().ToString());
-
-                    fMissingInputs = true;
-                    break;
-                }
-
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = nHeight - coins->nHeight;
-
-                dPriority = double_safe_addition(dPriority, ((double)nValueIn * nConf));
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            CFeeRate feeRate(nTotalIn - tx.GetValueOut(), nTxSize);
-
-            if (porphan) {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            } else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->GetTx()));
-        }
-
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty()) {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nMaxBlockSigOps = MAX_BLOCK_SIGOPS_CURRENT;
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
 
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee && ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority))) {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
+        // The staking thread keeps a selection for the current tip ready
+        if (!fProofOfStake || !stakingTemplate.CopyTo(pindexPrev, pblocktemplate.get(), nBlockMaxSize, nFees)) {
+            CBlockAssembler assembler(pblocktemplate.get(), nHeight, nBlockMaxSize, nBlockMinSize, nBlockPrioritySize);
+            assembler.AddPriorityTxs();
+            assembler.AddPackageTxs();
+            nFees = assembler.nFees;
 
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-                continue;
-
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, nHeight);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fPrintPriority && fDebug)
-                LogPrintf("priority %.1f fee %s txid %s\n", dPriority, feeRate.ToString(), tx.GetHash().ToString());
-
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash)) {
-                BOOST_FOREACH (COrphan* porphan, mapDependers[hash]) {
-                    if (!porphan->setDependsOn.empty()) {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty()) {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
+            nLastBlockTx = assembler.nBlockTx;
+            nLastBlockSize = assembler.nBlockSize;
         }
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
         // Compute final coinbase transaction.
         pblocktemplate->vTxFees[0] = -nFees;
 
@@ -516,6 +771,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
         CValidationState state;
         if (!TestBlockValidity(state, *pblock, pindexPrev, false, false)) {
             mempool.clear();
+            stakingTemplate.Clear();
             return NULL;
         }
         if (fDebug)
@@ -827,8 +1083,12 @@ bool ProcessBlockFound(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
         return error("KOREMiner : ProcessNewBlock, block not accepted");
     }
 
-    for (CNode* node : vNodes) {
-        node->PushInventory(CInv(MSG_BLOCK, pblock->GetHash()));
+    // ActivateBestChain already queued the block for a headers (or inv)
+    // announcement to every peer, unless we think we are still syncing
+    if (IsInitialBlockDownload()) {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes)
+            pnode->PushBlockHash(pblock->GetHash());
     }
 
     return true;
@@ -977,6 +1237,9 @@ void KoreMinter(CWallet* pwallet)
             continue;
         }
 
+        // Bring the transaction selection up to date before searching for a kernel
+        stakingTemplate.Refresh();
+
         unique_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey, pwallet, true));
         if (!pblocktemplate.get())
             continue;
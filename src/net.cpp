@@ -29,6 +29,10 @@
 #include <fcntl.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -95,15 +99,26 @@ uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
+bool fUseEpoll = false;
 bool fAddressesInitialized = false;
 std::string strSubVersion;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CRelayedTx> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
-limitedmap<uint256, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
+CAlreadyAskedFor mapAlreadyAskedFor;
+
+const std::string NET_MESSAGE_COMMAND_OTHER = "*other*";
+// Message statistics of all peers since startup
+static mapMsgCmdStats mapNetMsgStats;
+static CCriticalSection cs_mapNetMsgStats;
+
+#ifdef HAVE_SYS_EPOLL_H
+// The epoll instance ThreadSocketHandler waits on while fUseEpoll is set
+static int hEpoll = -1;
+#endif
 
 static deque<string> vOneShots;
 CCriticalSection cs_vOneShots;
@@ -118,7 +133,22 @@ NodeId nLastNodeId = 0;
 CCriticalSection cs_nLastNodeId;
 
 static CSemaphore* semOutbound = NULL;
+
+int nMessageHandlerThreads = DEFAULT_MESSAGE_HANDLER_THREADS;
 boost::condition_variable messageHandlerCondition;
+static boost::mutex mutexMessageHandler;
+// Per message handler thread: whether one of its peers got a complete message
+static bool vfMessageHandlerWake[MAX_MESSAGE_HANDLER_THREADS] = {};
+
+/** Wake the message handler thread that serves the given peer */
+static void WakeMessageHandler(NodeId id)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutexMessageHandler);
+        vfMessageHandlerWake[id % nMessageHandlerThreads] = true;
+    }
+    messageHandlerCondition.notify_all();
+}
 
 // Signals for message handling
 static CNodeSignals g_signals;
@@ -457,11 +487,43 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest)
     return NULL;
 }
 
+/**
+ * Register a socket with the epoll instance. Peer sockets are edge-triggered and
+ * carry their CNode, listening sockets are level-triggered and carry NULL.
+ */
+static bool EpollAddSocket(SOCKET hSocket, CNode* pnode)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (hEpoll == -1 || hSocket == INVALID_SOCKET)
+        return true;
+    struct epoll_event event;
+    event.events = pnode ? (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) : EPOLLIN;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocket, &event) != 0) {
+        LogPrintf("%s : epoll_ctl failed: %s\n", __func__, NetworkErrorString(errno));
+        return false;
+    }
+#endif
+    return true;
+}
+
+static void EpollRemoveSocket(SOCKET hSocket)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (hEpoll == -1 || hSocket == INVALID_SOCKET)
+        return;
+    // Kernels before 2.6.9 require a non-NULL event even for EPOLL_CTL_DEL
+    struct epoll_event event;
+    epoll_ctl(hEpoll, EPOLL_CTL_DEL, hSocket, &event);
+#endif
+}
+
 void CNode::CloseSocketDisconnect()
 {
     fDisconnect = true;
     if (hSocket != INVALID_SOCKET) {
         LogPrint("net", "disconnecting peer=%d\n", id);
+        EpollRemoveSocket(hSocket);
         CloseSocket(hSocket);
     }
 
@@ -710,17 +772,49 @@ void CNode::copyStats(CNodeStats& stats)
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    LOCK(cs_msgStats);
+    stats.mapMsgStats = mapMsgStats;
 }
 #undef X
 
+void CNode::RecordRecvMsg(const std::string& strCommand, unsigned int nBytes, int64_t nProcessTime, int64_t nLockTime)
+{
+    {
+        LOCK(cs_msgStats);
+        mapMsgStats[strCommand].AddRecv(nBytes, nProcessTime, nLockTime);
+    }
+    LOCK(cs_mapNetMsgStats);
+    mapNetMsgStats[strCommand].AddRecv(nBytes, nProcessTime, nLockTime);
+}
+
+void CNode::RecordSendMsg(const char* pchHeader, unsigned int nBytes)
+{
+    const char* pchCommand = pchHeader + MESSAGE_START_SIZE;
+    std::string strCommand(pchCommand, strnlen(pchCommand, CMessageHeader::COMMAND_SIZE));
+    {
+        LOCK(cs_msgStats);
+        mapMsgStats[strCommand].AddSend(nBytes);
+    }
+    LOCK(cs_mapNetMsgStats);
+    mapNetMsgStats[strCommand].AddSend(nBytes);
+}
+
+void GetNetMsgStats(mapMsgCmdStats& mapStats)
+{
+    LOCK(cs_mapNetMsgStats);
+    mapStats = mapNetMsgStats;
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
 {
+    bool fComplete = false;
     while (nBytes > 0) {
         // get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
             vRecvMsg.back().complete())
-            vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
+            vRecvMsg.emplace_back(SER_NETWORK, nRecvVersion);
 
         CNetMessage& msg = vRecvMsg.back();
 
@@ -729,7 +823,7 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
         if (!msg.in_data)
             handled = msg.readHeader(pch, nBytes);
         else
-            handled = msg.readData(pch, nBytes);
+            handled = msg.readData(pch, nBytes, recvBufferPool);
 
         if (handled < 0)
             return false;
@@ -744,32 +838,80 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
+            fComplete = true;
         }
     }
 
+    if (fComplete)
+        WakeMessageHandler(GetId());
+
     return true;
 }
 
+// requires LOCK(cs_vRecvMsg)
+void CNode::RecycleRecvBuffer(CNetMessage& msg)
+{
+    CSerializeData data;
+    msg.vRecv.clear();
+    msg.vRecv.Reuse(data);
+    recvBufferPool.Put(data);
+}
+
+void CNetBufferPool::Get(size_t nSize, CSerializeData& data)
+{
+    data.clear();
+    for (int nClass = 0; nClass < RECV_BUFFER_POOL_CLASSES; nClass++) {
+        if (ClassSize(nClass) < nSize)
+            continue;
+        if (!vBuffers[nClass].empty()) {
+            data.swap(vBuffers[nClass].back());
+            vBuffers[nClass].pop_back();
+            nPooledSize -= data.capacity();
+            return;
+        }
+        // Allocate the whole class size, so that the buffer is pooled in this class again
+        data.reserve(ClassSize(nClass));
+        return;
+    }
+    data.reserve(nSize);
+}
+
+void CNetBufferPool::Put(CSerializeData& data)
+{
+    size_t nCapacity = data.capacity();
+    data.clear();
+    for (int nClass = RECV_BUFFER_POOL_CLASSES - 1; nClass >= 0; nClass--) {
+        if (nCapacity < ClassSize(nClass))
+            continue;
+        // Buffers that grew past the next class (blocks) and a full pool are freed
+        if (nCapacity >= 4 * ClassSize(nClass) || nPooledSize + nCapacity > MAX_RECV_BUFFER_POOL_SIZE)
+            break;
+        vBuffers[nClass].push_back(CSerializeData());
+        vBuffers[nClass].back().swap(data);
+        nPooledSize += nCapacity;
+        return;
+    }
+    CSerializeData().swap(data);
+}
+
 int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
-    unsigned int nRemaining = 24 - nHdrPos;
+    unsigned int nRemaining = CMessageHeader::HEADER_SIZE - nHdrPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+    memcpy(&pchHdr[nHdrPos], pch, nCopy);
     nHdrPos += nCopy;
 
     // if header incomplete, exit
-    if (nHdrPos < 24)
+    if (nHdrPos < CMessageHeader::HEADER_SIZE)
         return nCopy;
 
-    // deserialize to CMessageHeader
-    try {
-        hdrbuf >> hdr;
-    } catch (const std::exception&) {
-        return -1;
-    }
+    // deserialize to CMessageHeader, the fields are stored back to back as EndMessage writes them
+    memcpy(hdr.pchMessageStart, &pchHdr[0], MESSAGE_START_SIZE);
+    memcpy(hdr.pchCommand, &pchHdr[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE);
+    memcpy(&hdr.nMessageSize, &pchHdr[CMessageHeader::MESSAGE_SIZE_OFFSET], CMessageHeader::MESSAGE_SIZE_SIZE);
+    memcpy(&hdr.nChecksum, &pchHdr[CMessageHeader::CHECKSUM_OFFSET], CMessageHeader::CHECKSUM_SIZE);
 
     // reject messages larger than MAX_SIZE
     if (hdr.nMessageSize > MAX_SIZE)
@@ -781,14 +923,20 @@ int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
     return nCopy;
 }
 
-int CNetMessage::readData(const char* pch, unsigned int nBytes)
+int CNetMessage::readData(const char* pch, unsigned int nBytes, CNetBufferPool& pool)
 {
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
     if (vRecv.size() < nDataPos + nCopy) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        unsigned int nNewSize = std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024);
+        if (nDataPos == 0) {
+            CSerializeData data;
+            pool.Get(nNewSize, data);
+            vRecv.Reuse(data);
+        }
+        vRecv.resize(nNewSize);
     }
 
     memcpy(&vRecv[nDataPos], pch, nCopy);
@@ -801,22 +949,50 @@ int CNetMessage::readData(const char* pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode* pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSerializedNetMsg>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData& data = *it;
-        assert(data.size() > pnode->nSendOffset);
+        assert((*it)->size() > pnode->nSendOffset);
+#ifndef WIN32
+        // Hand as many queued messages as possible to the kernel in one call
+        struct iovec vIov[MAX_SEND_IOVECS];
+        int nIov = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<CSerializedNetMsg>::iterator itIov = it; itIov != pnode->vSendMsg.end() && nIov < MAX_SEND_IOVECS; itIov++) {
+            CSerializeData& data = **itIov;
+            vIov[nIov].iov_base = &data[nOffset];
+            vIov[nIov].iov_len = data.size() - nOffset;
+            nIov++;
+            nOffset = 0;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = vIov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        const CSerializeData& data = **it;
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            // Retire the messages that went out completely
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                size_t nSize = (*it)->size();
+                if (nLeft < nSize - pnode->nSendOffset) {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nSize - pnode->nSendOffset;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= nSize;
+                pnode->RecycleSendBuffer(*it);
                 it++;
-            } else {
+            }
+            if (pnode->nSendOffset != 0) {
                 // could not send full message; stop sending more
                 break;
             }
@@ -888,9 +1064,160 @@ static bool ReverseCompareNodeMinPingTime(const CNodeRef& a, const CNodeRef& b)
     return a->nMinPingUsecTime > b->nMinPingUsecTime;
 }
 
+/**
+ * Decide whether to read from or write to a peer's socket, implementing the
+ * following logic:
+ * * If there is data to send, wait for sending data. As this only happens
+ *   when optimistic write failed, we choose to first drain the write buffer in
+ *   this case before receiving more. This avoids needlessly queueing received
+ *   data, if the remote peer is not themselves receiving data. This means
+ *   properly utilizing TCP flow control signalling.
+ * * Otherwise, if there is no (complete) message in the receive buffer, or
+ *   there is space left in the buffer, wait for receiving data.
+ * * (if neither of the above applies, there is certainly one message in the
+ *   receiver buffer ready to be processed).
+ * Together, that means that at least one of the following is always possible,
+ * so we don't deadlock:
+ * * We send some data.
+ * * We wait for data to be received (and disconnect after timeout).
+ * * We process a message in the buffer (message handler thread).
+ */
+static void GetSocketInterest(CNode* pnode, bool& fWantRecv, bool& fWantSend)
+{
+    fWantRecv = false;
+    fWantSend = false;
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend && !pnode->vSendMsg.empty()) {
+            fWantSend = true;
+            return;
+        }
+    }
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                            pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+            fWantRecv = true;
+    }
+}
+
+/** Wait for the sockets we are interested in with select(), and set the ready flags of every peer */
+static void SocketEventsSelect(std::set<SOCKET>& setListenReady)
+{
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket.socket);
+        have_fds = true;
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, pnode->hSocket);
+            have_fds = true;
+
+            bool fWantRecv, fWantSend;
+            GetSocketInterest(pnode, fWantRecv, fWantSend);
+            if (fWantSend)
+                FD_SET(pnode->hSocket, &fdsetSend);
+            else if (fWantRecv)
+                FD_SET(pnode->hSocket, &fdsetRecv);
+        }
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+        &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
+
+    if (nSelect == SOCKET_ERROR) {
+        if (have_fds) {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(timeout.tv_usec / 1000);
+    }
+
+    BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket)
+        if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            setListenReady.insert(hListenSocket.socket);
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            SOCKET hSocket = pnode->hSocket;
+            if (hSocket == INVALID_SOCKET || hSocket > hSocketMax) {
+                pnode->fSocketRecvReady = false;
+                pnode->fSocketSendReady = false;
+                continue;
+            }
+            pnode->fSocketRecvReady = FD_ISSET(hSocket, &fdsetRecv) || FD_ISSET(hSocket, &fdsetError);
+            pnode->fSocketSendReady = FD_ISSET(hSocket, &fdsetSend);
+        }
+    }
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/**
+ * Wait for socket events with epoll. Peer sockets are edge-triggered, so their
+ * ready flags stay set until a read or write finds the socket exhausted; the
+ * cost of a wakeup only depends on the number of sockets that changed. Does not
+ * block when fMoreData says some peer still has data waiting to be read.
+ */
+static void SocketEventsEpoll(bool fMoreData, std::set<SOCKET>& setListenReady)
+{
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int nEvents = epoll_wait(hEpoll, events, MAX_EPOLL_EVENTS, fMoreData ? 0 : 50);
+    if (nEvents < 0) {
+        if (errno != EINTR) {
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+            MilliSleep(50);
+        }
+        return;
+    }
+
+    for (int i = 0; i < nEvents; i++) {
+        CNode* pnode = (CNode*)events[i].data.ptr;
+        if (pnode == NULL) {
+            // A listening socket; accept() on one that has nothing waiting just fails with EWOULDBLOCK
+            BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket)
+                if (hListenSocket.socket != INVALID_SOCKET)
+                    setListenReady.insert(hListenSocket.socket);
+            continue;
+        }
+        // Peers are only deleted by ThreadSocketHandler itself, after their
+        // socket was taken out of the epoll set
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            pnode->fSocketRecvReady = true;
+        if (events[i].events & EPOLLOUT)
+            pnode->fSocketSendReady = true;
+    }
+}
+#endif
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    bool fMoreData = false;
     while (true) {
         //
         // Disconnect nodes
@@ -956,86 +1283,20 @@ void ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH (CNode* pnode, vNodes) {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
-        }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-            &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        std::set<SOCKET> setListenReady;
+#ifdef HAVE_SYS_EPOLL_H
+        if (fUseEpoll)
+            SocketEventsEpoll(fMoreData, setListenReady);
+        else
+#endif
+            SocketEventsSelect(setListenReady);
         boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR) {
-            if (have_fds) {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec / 1000);
-        }
-
         //
         // Accept new connections
         //
         BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
+            if (hListenSocket.socket != INVALID_SOCKET && setListenReady.count(hListenSocket.socket)) {
                 struct sockaddr_storage sockaddr;
                 socklen_t len = sizeof(sockaddr);
                 SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
@@ -1058,7 +1319,7 @@ void ThreadSocketHandler()
                     int nErr = WSAGetLastError();
                     if (nErr != WSAEWOULDBLOCK)
                         LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                } else if (!IsSelectableSocket(hSocket)) {
+                } else if (!fUseEpoll && !IsSelectableSocket(hSocket)) {
                     LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
                     CloseSocket(hSocket);
                 } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
@@ -1090,15 +1351,22 @@ void ThreadSocketHandler()
             BOOST_FOREACH (CNode* pnode, vNodesCopy)
                 pnode->AddRef();
         }
+        fMoreData = false;
         BOOST_FOREACH (CNode* pnode, vNodesCopy) {
             boost::this_thread::interruption_point();
 
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            // select() was only asked about what we wanted, epoll reports everything
+            bool fWantRecv = true;
+            bool fWantSend = true;
+            if (fUseEpoll)
+                GetSocketInterest(pnode, fWantRecv, fWantSend);
+
             //
             // Receive
             //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)) {
+            if (pnode->fSocketRecvReady && fWantRecv) {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv) {
                     {
@@ -1111,6 +1379,12 @@ void ThreadSocketHandler()
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
                             pnode->RecordBytesRecv(nBytes);
+                            // A short read drained the socket, epoll reports the next
+                            // arrival. Otherwise come back without waiting.
+                            if ((size_t)nBytes < sizeof(pchBuf))
+                                pnode->fSocketRecvReady = false;
+                            else
+                                fMoreData = true;
                         } else if (nBytes == 0) {
                             // socket closed gracefully
                             if (!pnode->fDisconnect)
@@ -1119,6 +1393,8 @@ void ThreadSocketHandler()
                         } else if (nBytes < 0) {
                             // error
                             int nErr = WSAGetLastError();
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fSocketRecvReady = false;
                             if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
                                 if (!pnode->fDisconnect)
                                     LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
@@ -1134,10 +1410,15 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend)) {
+            if (pnode->fSocketSendReady && fWantSend) {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
+                if (lockSend) {
                     SocketSendData(pnode);
+                    // Whatever is left did not fit the socket buffer, wait for
+                    // it to be reported writable again
+                    if (!pnode->vSendMsg.empty())
+                        pnode->fSocketSendReady = false;
+                }
             }
 
             //
@@ -1745,19 +2026,25 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant* grantOu
 }
 
 
-void ThreadMessageHandler()
+void ThreadMessageHandler(int nThread)
 {
-    boost::mutex condition_mutex;
-    boost::unique_lock<boost::mutex> lock(condition_mutex);
-
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (!ShutdownRequested()) {
+        {
+            boost::lock_guard<boost::mutex> lock(mutexMessageHandler);
+            vfMessageHandlerWake[nThread] = false;
+        }
+
+        // Every peer is served by exactly one handler thread, which keeps its
+        // messages in order
         vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH (CNode* pnode, vNodesCopy) {
+            BOOST_FOREACH (CNode* pnode, vNodes) {
+                if (pnode->GetId() % nMessageHandlerThreads != nThread)
+                    continue;
                 pnode->AddRef();
+                vNodesCopy.push_back(pnode);
             }
         }
 
@@ -1804,8 +2091,13 @@ void ThreadMessageHandler()
         }
 
         if (fSleep) {
-            std::chrono::system_clock::time_point until = std::chrono::system_clock::time_point(std::chrono::system_clock::now()) + std::chrono::milliseconds(100);
-            std::this_thread::sleep_until(until);
+            // Wait for ThreadSocketHandler to report a complete message, or for
+            // the next round of SendMessages' periodic work
+            boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+            boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(100);
+            while (!vfMessageHandlerWake[nThread])
+                if (!messageHandlerCondition.timed_wait(lock, deadline))
+                    break;
         }
     }
 }
@@ -1979,6 +2271,22 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     if (pnodeLocalHost == NULL)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0), nLocalServices));
 
+#ifdef HAVE_SYS_EPOLL_H
+    if (fUseEpoll && hEpoll == -1) {
+        hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpoll == -1) {
+            LogPrintf("Could not create epoll instance (%s), using select()\n", NetworkErrorString(errno));
+            fUseEpoll = false;
+        } else {
+            BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket)
+                EpollAddSocket(hListenSocket.socket, NULL);
+        }
+    }
+#else
+    fUseEpoll = false;
+#endif
+    LogPrintf("Waiting for socket events with %s\n", fUseEpoll ? "epoll" : "select()");
+
     Discover(threadGroup);
 
     //
@@ -2003,7 +2311,8 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", boost::function<void()>(boost::bind(&ThreadMessageHandler, i))));
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
@@ -2052,6 +2361,12 @@ public:
         vNodes.clear();
         vNodesDisconnected.clear();
         vhListenSocket.clear();
+#ifdef HAVE_SYS_EPOLL_H
+        if (hEpoll != -1) {
+            close(hEpoll);
+            hEpoll = -1;
+        }
+#endif
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
@@ -2074,14 +2389,16 @@ void CExplicitNetCleanup::callCleanup()
 
 void RelayTransaction(const CTransaction& tx)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, ss);
+    // Share the mempool's copy when there is one
+    CTransactionRef ptx = mempool.get(tx.GetHash());
+    if (!ptx)
+        ptx = MakeTransactionRef(tx);
+    RelayTransaction(ptx);
 }
 
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
+void RelayTransaction(const CTransactionRef& ptx)
 {
+    const CTransaction& tx = *ptx;
     CInv inv(MSG_TX, tx.GetHash());
     {
         LOCK(cs_mapRelay);
@@ -2091,8 +2408,7 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        mapRelay.insert(std::make_pair(inv, CRelayedTx(ptx)));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
@@ -2389,6 +2705,8 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
+    fSocketRecvReady = false;
+    fSocketSendReady = false;
     hashContinue = 0;
     nStartingHeight = -1;
     fGetAddr = false;
@@ -2413,6 +2731,9 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     else
         LogPrint("net", "Added connection peer=%d\n", id);
 
+    if (!EpollAddSocket(hSocket, this))
+        fDisconnect = true;
+
     // Be shy and don't send version until we hear
     if (hSocket != INVALID_SOCKET && !fInbound)
         PushVersion();
@@ -2422,6 +2743,7 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
 
 CNode::~CNode()
 {
+    EpollRemoveSocket(hSocket);
     CloseSocket(hSocket);
 
     if (pfilter)
@@ -2430,6 +2752,57 @@ CNode::~CNode()
     GetNodeSignals().FinalizeNode(GetId());
 }
 
+CAlreadyAskedFor::Entry* CAlreadyAskedFor::GetBucket(const uint256& hash, uint64_t& nKey)
+{
+    if (vEntries.empty()) {
+        // Salted, so that announcements can't be aimed at a single bucket
+        vEntries.resize((1 << BUCKET_BITS) * BUCKET_ENTRIES);
+        k0 = GetRand(std::numeric_limits<uint64_t>::max());
+        k1 = GetRand(std::numeric_limits<uint64_t>::max());
+    }
+    nKey = SipHashUint256(k0, k1, hash);
+    return &vEntries[(nKey >> (64 - BUCKET_BITS)) * BUCKET_ENTRIES];
+}
+
+int64_t CAlreadyAskedFor::Get(const uint256& hash)
+{
+    uint64_t nKey;
+    const Entry* pbucket = GetBucket(hash, nKey);
+    for (unsigned int i = 0; i < BUCKET_ENTRIES; i++) {
+        if (pbucket[i].nRequestTime != 0 && pbucket[i].nKey == nKey)
+            return pbucket[i].nRequestTime;
+    }
+    return 0;
+}
+
+void CAlreadyAskedFor::Set(const uint256& hash, int64_t nRequestTime)
+{
+    uint64_t nKey;
+    Entry* pbucket = GetBucket(hash, nKey);
+    Entry* pentry = &pbucket[0];
+    for (unsigned int i = 0; i < BUCKET_ENTRIES; i++) {
+        if (pbucket[i].nRequestTime != 0 && pbucket[i].nKey == nKey) {
+            pentry = &pbucket[i];
+            break;
+        }
+        // Free entries have the lowest time of all
+        if (pbucket[i].nRequestTime < pentry->nRequestTime)
+            pentry = &pbucket[i];
+    }
+    pentry->nKey = nKey;
+    pentry->nRequestTime = nRequestTime;
+}
+
+void CAlreadyAskedFor::Erase(const uint256& hash)
+{
+    uint64_t nKey;
+    Entry* pbucket = GetBucket(hash, nKey);
+    for (unsigned int i = 0; i < BUCKET_ENTRIES; i++) {
+        if (pbucket[i].nRequestTime != 0 && pbucket[i].nKey == nKey)
+            pbucket[i].nRequestTime = 0;
+    }
+}
+
 void CNode::AskFor(const CInv& inv)
 {
     if (mapAskFor.size() > MAPASKFOR_MAX_SZ || setAskFor.size() > SETASKFOR_MAX_SZ)
@@ -2439,12 +2812,7 @@ void CNode::AskFor(const CInv& inv)
         return;
     // We're using mapAskFor as a priority queue,
     // the key is the earliest time the request can be sent
-    int64_t nRequestTime;
-    limitedmap<uint256, int64_t>::const_iterator it = mapAlreadyAskedFor.find(inv.hash);
-    if (it != mapAlreadyAskedFor.end())
-        nRequestTime = it->second;
-    else
-        nRequestTime = 0;
+    int64_t nRequestTime = mapAlreadyAskedFor.Get(inv.hash);
     LogPrint("net", "askfor %s  %d (%s) peer=%d\n", inv.ToString(), nRequestTime, DateTimeStrFormat("%H:%M:%S", nRequestTime / 1000000), id);
 
     // Make sure not to reuse time indexes to keep things in the same order
@@ -2456,10 +2824,7 @@ void CNode::AskFor(const CInv& inv)
 
     // Each retry is 2 minutes after the last
     nRequestTime = std::max(nRequestTime + 2 * 60 * 1000000, nNow);
-    if (it != mapAlreadyAskedFor.end())
-        mapAlreadyAskedFor.update(it, nRequestTime);
-    else
-        mapAlreadyAskedFor.insert(std::make_pair(inv.hash, nRequestTime));
+    mapAlreadyAskedFor.Set(inv.hash, nRequestTime);
     mapAskFor.insert(std::make_pair(nRequestTime, inv));
 }
 
@@ -2467,6 +2832,10 @@ void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSen
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
     assert(ssSend.size() == 0);
+    if (!vSendBufferPool.empty()) {
+        ssSend.Reuse(vSendBufferPool.back());
+        vSendBufferPool.pop_back();
+    }
     ssSend << CMessageHeader(pszCommand, 0);
     LogPrint("net", "sending: %s ", SanitizeString(pszCommand));
 }
@@ -2497,30 +2866,77 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
         LEAVE_CRITICAL_SECTION(cs_vSend);
         return;
     }
-    // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+    FinalizeMessageHeader(ssSend);
 
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
-
-    LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
+    LogPrint("net", "(%d bytes) peer=%d\n", ssSend.size() - CMessageHeader::HEADER_SIZE, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    // The queue takes over the stream's storage, ssSend continues with a pooled buffer
+    CSerializedNetMsg msg = boost::make_shared<CSerializeData>();
+    ssSend.GetAndClear(*msg);
+    RecordSendMsg(&(*msg)[0], msg->size());
+    nSendSize += msg->size();
+    vSendMsg.push_back(msg);
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
 
+void CNode::PushSerializedMessage(const CSerializedNetMsg& msg)
+{
+    LOCK(cs_vSend);
+    LogPrint("net", "sending: %s (%d bytes, shared) peer=%d\n",
+        SanitizeString(std::string(&(*msg)[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE).c_str()),
+        msg->size() - CMessageHeader::HEADER_SIZE, id);
+
+    RecordSendMsg(&(*msg)[0], msg->size());
+    nSendSize += msg->size();
+    vSendMsg.push_back(msg);
+
+    // If write queue empty, attempt "optimistic write"
+    if (vSendMsg.size() == 1)
+        SocketSendData(this);
+}
+
+void CNode::RecycleSendBuffer(CSerializedNetMsg& msg)
+{
+    // Messages still queued for other peers can't be recycled, and large
+    // buffers (blocks) are not worth keeping around for every peer
+    if (msg.unique() && vSendBufferPool.size() < MAX_SEND_BUFFER_POOL && msg->capacity() <= MAX_POOLED_SEND_BUFFER_SIZE) {
+        vSendBufferPool.push_back(CSerializeData());
+        vSendBufferPool.back().swap(*msg);
+    }
+    msg.reset();
+}
+
+CSerializedNetMsg MakeSerializedNetMsg(const char* pszCommand, const char* pbegin, size_t nSize)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(CMessageHeader::HEADER_SIZE + nSize);
+    ss << CMessageHeader(pszCommand, 0);
+    ss.write(pbegin, nSize);
+    FinalizeMessageHeader(ss);
+    CSerializedNetMsg msg = boost::make_shared<CSerializeData>();
+    ss.GetAndClear(*msg);
+    return msg;
+}
+
+void FinalizeMessageHeader(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+}
+
 //
 // CBanDB
 //
@@ -10,9 +10,8 @@
 #include "bloom.h"
 #include "compat.h"
 #include "hash.h"
-#include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
+#include "primitives/transaction.h"
 #include "protocol.h"
 #include "random.h"
 #include "streams.h"
@@ -29,6 +28,8 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
@@ -56,6 +57,26 @@ static const unsigned int MAX_SUBVERSION_LENGTH = 256;
 static const bool DEFAULT_BLOCKSONLY_LEGACY = false;
 /** -listen default */
 static const bool DEFAULT_LISTEN = true;
+/** Default number of threads processing peer messages */
+static const int DEFAULT_MESSAGE_HANDLER_THREADS = 1;
+/** Maximum number of threads processing peer messages */
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
+/** -epoll default */
+static const bool DEFAULT_EPOLL = true;
+/** Maximum number of socket events taken from epoll per wakeup */
+static const int MAX_EPOLL_EVENTS = 256;
+/** Maximum number of queued messages handed to the kernel by one sendmsg() call */
+static const int MAX_SEND_IOVECS = 64;
+/** Maximum number of emptied send buffers a peer keeps for its next messages */
+static const size_t MAX_SEND_BUFFER_POOL = 8;
+/** Send buffers with more capacity than this are freed instead of kept for reuse */
+static const size_t MAX_POOLED_SEND_BUFFER_SIZE = 64 * 1024;
+/** Smallest size class of the receive buffer pool, the next classes are 4 times larger each */
+static const size_t MIN_POOLED_RECV_BUFFER_SIZE = 1024;
+/** Number of size classes of the receive buffer pool (1 KiB to 256 KiB) */
+static const int RECV_BUFFER_POOL_CLASSES = 5;
+/** Maximum total capacity of the emptied receive buffers a peer keeps */
+static const size_t MAX_RECV_BUFFER_POOL_SIZE = 512 * 1024;
 /** -upnp default */
 #ifdef USE_UPNP
 static const bool DEFAULT_UPNP = USE_UPNP;
@@ -97,6 +118,71 @@ void SocketSendData(CNode *pnode);
 
 typedef int NodeId;
 
+/**
+ * Earliest time at which each announced inventory item may be requested from
+ * a peer again, shared by all peers. A fixed table of 4 entry buckets indexed
+ * by a salted hash of the item: when a bucket is full, the entry with the
+ * lowest request time makes room, much like limitedmap keeps the highest
+ * values. Memory is allocated once, on first use. Requires cs_main.
+ */
+class CAlreadyAskedFor
+{
+private:
+    static const unsigned int BUCKET_BITS = 14;
+    static const unsigned int BUCKET_ENTRIES = 4;
+
+    struct Entry {
+        uint64_t nKey;
+        int64_t nRequestTime; // 0 for free entries
+    };
+
+    std::vector<Entry> vEntries;
+    uint64_t k0, k1;
+
+    /** The bucket of hash, and its key within it */
+    Entry* GetBucket(const uint256& hash, uint64_t& nKey);
+
+public:
+    /** The request time recorded for hash, 0 if there is none */
+    int64_t Get(const uint256& hash);
+    void Set(const uint256& hash, int64_t nRequestTime);
+    void Erase(const uint256& hash);
+};
+
+
+/**
+ * A message as it goes on the wire, header included. Messages framed with
+ * MakeSerializedNetMsg are shared by the send queues of all peers they are
+ * pushed to.
+ */
+typedef boost::shared_ptr<CSerializeData> CSerializedNetMsg;
+
+/** Fill in the payload size and checksum of the message header at the front of ss */
+void FinalizeMessageHeader(CDataStream& ss);
+
+/** Serialize and checksum a message once, for CNode::PushSerializedMessage to any number of peers */
+template <typename T>
+CSerializedNetMsg MakeSerializedNetMsg(const char* pszCommand, const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(pszCommand, 0) << obj;
+    FinalizeMessageHeader(ss);
+    CSerializedNetMsg msg = boost::make_shared<CSerializeData>();
+    ss.GetAndClear(*msg);
+    return msg;
+}
+
+/** Frame an already serialized payload, e.g. a block as stored in its block file */
+CSerializedNetMsg MakeSerializedNetMsg(const char* pszCommand, const char* pbegin, size_t nSize);
+
+/** A transaction we relay, with its tx message once a peer asked for it */
+struct CRelayedTx {
+    CTransactionRef tx;
+    CSerializedNetMsg msg;
+
+    explicit CRelayedTx(const CTransactionRef& txIn) : tx(txIn) {}
+};
+
 // Signals for message handling
 struct CNodeSignals {
     boost::signals2::signal<int()> GetHeight;
@@ -146,13 +232,15 @@ extern uint64_t nLocalServices;
 extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
+extern bool fUseEpoll;
+extern int nMessageHandlerThreads;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CRelayedTx> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
-extern limitedmap<uint256, int64_t> mapAlreadyAskedFor;
+extern CAlreadyAskedFor mapAlreadyAskedFor;
 
 extern std::vector<std::string> vAddedNodes;
 extern CCriticalSection cs_vAddedNodes;
@@ -171,6 +259,44 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/** Traffic and processing time of one message type, see getpeerinfo and getnetmsgstats */
+struct CNetMsgStats {
+    uint64_t nRecvCount;
+    uint64_t nRecvBytes;
+    uint64_t nSendCount;
+    uint64_t nSendBytes;
+    //! Time (in microseconds) spent processing received messages of this type, in total and at most for one
+    int64_t nProcessTime;
+    int64_t nMaxProcessTime;
+    //! Time (in microseconds) cs_main was held while processing them
+    int64_t nLockTime;
+
+    CNetMsgStats() : nRecvCount(0), nRecvBytes(0), nSendCount(0), nSendBytes(0), nProcessTime(0), nMaxProcessTime(0), nLockTime(0) {}
+
+    void AddRecv(unsigned int nBytes, int64_t nProcessTimeIn, int64_t nLockTimeIn)
+    {
+        nRecvCount++;
+        nRecvBytes += nBytes;
+        nProcessTime += nProcessTimeIn;
+        nMaxProcessTime = std::max(nMaxProcessTime, nProcessTimeIn);
+        nLockTime += nLockTimeIn;
+    }
+
+    void AddSend(unsigned int nBytes)
+    {
+        nSendCount++;
+        nSendBytes += nBytes;
+    }
+};
+
+typedef std::map<std::string, CNetMsgStats> mapMsgCmdStats;
+
+/** Message type under which received messages with a command we don't know are counted */
+extern const std::string NET_MESSAGE_COMMAND_OTHER;
+
+/** Copy the message statistics of all peers since startup */
+void GetNetMsgStats(mapMsgCmdStats& mapStats);
+
 class CNodeStats
 {
 public:
@@ -192,16 +318,41 @@ public:
     double dPingWait;
     double dPingMin;
     std::string addrLocal;
+    mapMsgCmdStats mapMsgStats;
 };
 
 
 
 
+/**
+ * Emptied payload buffers of received messages, kept by size class so that the
+ * next message of about the same size is read without allocating. Pooled
+ * buffers are never freed, so they skip the wipe of zero_after_free_allocator
+ * as well. Used under the cs_vRecvMsg lock of the peer that owns it.
+ */
+class CNetBufferPool
+{
+private:
+    std::vector<CSerializeData> vBuffers[RECV_BUFFER_POOL_CLASSES];
+    size_t nPooledSize;
+
+    static size_t ClassSize(int nClass) { return MIN_POOLED_RECV_BUFFER_SIZE << (2 * nClass); }
+
+public:
+    CNetBufferPool() : nPooledSize(0) {}
+
+    /** Make data an empty buffer with room for at least nSize bytes */
+    void Get(size_t nSize, CSerializeData& data);
+    /** Keep the storage of data for a later Get, or free it. Leaves data empty. */
+    void Put(CSerializeData& data);
+};
+
+
 class CNetMessage {
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
-    CDataStream hdrbuf;             // partially received header
+    char pchHdr[CMessageHeader::HEADER_SIZE]; // partially received header
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
@@ -210,9 +361,8 @@ public:
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
+    CNetMessage(int nTypeIn, int nVersionIn) : vRecv(nTypeIn, nVersionIn)
     {
-        hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
@@ -228,12 +378,12 @@ public:
 
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
     int readHeader(const char *pch, unsigned int nBytes);
-    int readData(const char *pch, unsigned int nBytes);
+    /** Append payload bytes, taking the payload buffer from pool when the first ones arrive */
+    int readData(const char *pch, unsigned int nBytes, CNetBufferPool& pool);
 };
 
 
@@ -309,12 +459,22 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializedNetMsg> vSendMsg;
+    //! Storage of sent messages, reused by the next BeginMessage calls
+    std::vector<CSerializeData> vSendBufferPool;
     CCriticalSection cs_vSend;
+    // Socket readiness as last reported to ThreadSocketHandler, only used by that thread
+    bool fSocketRecvReady;
+    bool fSocketSendReady;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
+    //! Storage of processed messages, reused for the payloads of the next ones
+    CNetBufferPool recvBufferPool;
     CCriticalSection cs_vRecvMsg;
+    //! Statistics per message type, protected by cs_msgStats
+    mapMsgCmdStats mapMsgStats;
+    CCriticalSection cs_msgStats;
     uint64_t nRecvBytes;
     int nRecvVersion;
 
@@ -447,6 +607,14 @@ public:
         return total;
     }
 
+    // requires LOCK(cs_vRecvMsg)
+    void RecycleRecvBuffer(CNetMessage& msg);
+
+    /** Count a processed message of type strCommand, of nBytes including the header */
+    void RecordRecvMsg(const std::string& strCommand, unsigned int nBytes, int64_t nProcessTime, int64_t nLockTime);
+    /** Count a queued message, of which pchHeader is the header */
+    void RecordSendMsg(const char* pchHeader, unsigned int nBytes);
+
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
@@ -525,6 +693,12 @@ public:
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
     void EndMessage() UNLOCK_FUNCTION(cs_vSend);
 
+    /** Queue a message framed by MakeSerializedNetMsg, without serializing or copying it again */
+    void PushSerializedMessage(const CSerializedNetMsg& msg);
+
+    /** Keep the storage of a sent message for reuse if no other peer still queues it. Requires cs_vSend. */
+    void RecycleSendBuffer(CSerializedNetMsg& msg);
+
     void PushVersion();
 
 
@@ -794,9 +968,8 @@ public:
     static void callCleanup();
 };
 
-class CTransaction;
 void RelayTransaction(const CTransaction& tx);
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
+void RelayTransaction(const CTransactionRef& ptx);
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll = false);
 void RelayInv(CInv& inv);
 
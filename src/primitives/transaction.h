@@ -14,6 +14,9 @@
 
 #include <list>
 
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+
 class CTransaction;
 
 /** An outpoint - a combination of a transaction hash and an index n into its vout */
@@ -424,4 +427,8 @@ struct CMutableTransaction {
     }
 };
 
+/** Immutable transaction shared by the mempool, the relay map and the orphan pool */
+typedef boost::shared_ptr<const CTransaction> CTransactionRef;
+static inline CTransactionRef MakeTransactionRef(const CTransaction& tx) { return boost::make_shared<CTransaction>(tx); }
+
 #endif // BITCOIN_PRIMITIVES_TRANSACTION_H
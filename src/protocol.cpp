@@ -38,6 +38,10 @@ const char *FILTERADD="filteradd";
 const char *FILTERCLEAR="filterclear";
 const char *REJECT="reject";
 const char *SENDHEADERS="sendheaders";
+const char *SENDCMPCT="sendcmpct";
+const char *CMPCTBLOCK="cmpctblock";
+const char *GETBLOCKTXN="getblocktxn";
+const char *BLOCKTXN="blocktxn";
 };
 
 static const char* ppszTypeName[] =
@@ -45,7 +49,8 @@ static const char* ppszTypeName[] =
         "ERROR",
         "tx",
         "block",
-        "filtered block"};
+        "filtered block",
+        "compact block"};
 
 CMessageHeader::CMessageHeader()
 {
@@ -160,7 +160,9 @@ enum {
     MSG_BLOCK,
     // Nodes may always request a MSG_FILTERED_BLOCK in a getdata, however,
     // MSG_FILTERED_BLOCK should not appear in any invs except as a part of getdata.
-    MSG_FILTERED_BLOCK
+    MSG_FILTERED_BLOCK,
+    // MSG_CMPCT_BLOCK is only used in getdata, and asks for a cmpctblock message
+    MSG_CMPCT_BLOCK
 };
 
 /**
@@ -316,5 +318,31 @@ extern const char *REJECT;
  * @see https://kore.org/en/developer-reference#sendheaders
  */
 extern const char *SENDHEADERS;
+/**
+ * Contains a 1-byte bool and 8-byte LE version number.
+ * Indicates that a node is willing to provide blocks via "cmpctblock" messages.
+ * May indicate that a node prefers to receive new block announcements via a
+ * "cmpctblock" message rather than an "inv", depending on message contents.
+ * @since negotiated by sendcmpct as described by BIP152.
+ */
+extern const char *SENDCMPCT;
+/**
+ * Contains a CBlockHeaderAndShortTxIDs object - providing a header and
+ * list of "short txids".
+ * @since negotiated by sendcmpct as described by BIP152.
+ */
+extern const char *CMPCTBLOCK;
+/**
+ * Contains a BlockTransactionsRequest
+ * Peer should respond with "blocktxn" message.
+ * @since negotiated by sendcmpct as described by BIP152.
+ */
+extern const char *GETBLOCKTXN;
+/**
+ * Contains a BlockTransactions.
+ * Sent in response to a "getblocktxn" message.
+ * @since negotiated by sendcmpct as described by BIP152.
+ */
+extern const char *BLOCKTXN;
 };
 #endif // BITCOIN_PROTOCOL_H
@@ -197,8 +197,10 @@ std::string BlockToString(CBlockIndex* pBlock)
     if (!pBlock)
         return "";
 
-    CBlock block;
-    ReadBlockFromDisk(block, pBlock);
+    boost::shared_ptr<const CBlock> pblock;
+    if (!ReadBlockFromDisk(pblock, pBlock))
+        return "";
+    const CBlock& block = *pblock;
 
     CAmount Fees = 0;
     CAmount OutVolume = 0;
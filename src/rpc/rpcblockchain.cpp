@@ -330,6 +330,76 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
     return mempoolToJSON(fVerbose);
 }
 
+UniValue getmempoolchanges(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getmempoolchanges since_sequence\n"
+            "\nReturns the transactions added to and removed from the memory pool after the given sequence number.\n"
+            "Start with 0 and pass the returned sequence on the next call. If the changes no longer reach back that\n"
+            "far, the whole pool is returned instead. Sequence numbers restart at 0 when the node restarts.\n"
+
+            "\nArguments:\n"
+            "1. since_sequence    (numeric, required) the sequence number returned by the previous call\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"sequence\" : n,       (numeric) the sequence number of the last change\n"
+            "  \"resync\" : true|false, (boolean) whether the changes were unavailable and \"txids\" holds the whole pool\n"
+            "  \"txids\" : [           (array) all transaction ids in the pool, only if resync is true\n"
+            "      \"transactionid\",\n"
+            "      ...\n"
+            "  ],\n"
+            "  \"changes\" : [         (array) the changes in order, only if resync is false\n"
+            "    {\n"
+            "      \"sequence\" : n,   (numeric) the sequence number of the change\n"
+            "      \"txid\" : \"id\",    (string) the transaction id\n"
+            "      \"action\" : \"xxx\", (string) \"added\" or \"removed\"\n"
+            "      \"reason\" : \"xxx\"  (string) for removals: block, conflict, reorg, expiry, sizelimit, replaced or unknown\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+
+            "\nExamples\n" +
+            HelpExampleCli("getmempoolchanges", "0") + HelpExampleRpc("getmempoolchanges", "0"));
+
+    int64_t nSince = params[0].get_int64();
+    if (nSince < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative sequence number");
+
+    UniValue ret(UniValue::VOBJ);
+    std::vector<CMemPoolChange> vChanges;
+    uint64_t nSequence;
+
+    LOCK(mempool.cs);
+    if (!mempool.GetChangesSince(nSince, vChanges, nSequence)) {
+        std::vector<uint256> vtxid;
+        mempool.queryHashes(vtxid);
+        UniValue txids(UniValue::VARR);
+        BOOST_FOREACH (const uint256& hash, vtxid)
+            txids.push_back(hash.ToString());
+        ret.push_back(Pair("sequence", (int64_t)nSequence));
+        ret.push_back(Pair("resync", true));
+        ret.push_back(Pair("txids", txids));
+        return ret;
+    }
+
+    UniValue changes(UniValue::VARR);
+    BOOST_FOREACH (const CMemPoolChange& change, vChanges) {
+        UniValue entry(UniValue::VOBJ);
+        entry.push_back(Pair("sequence", (int64_t)change.nSequence));
+        entry.push_back(Pair("txid", change.txid.ToString()));
+        entry.push_back(Pair("action", change.fAdded ? "added" : "removed"));
+        if (!change.fAdded)
+            entry.push_back(Pair("reason", MemPoolRemovalReasonToString(change.reason)));
+        changes.push_back(entry);
+    }
+    ret.push_back(Pair("sequence", (int64_t)nSequence));
+    ret.push_back(Pair("resync", false));
+    ret.push_back(Pair("changes", changes));
+    return ret;
+}
+
 UniValue getblockhash(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -408,11 +478,12 @@ UniValue getblock(const UniValue& params, bool fHelp)
     if (mapBlockIndex.count(hash) == 0)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
-    CBlock block;
+    boost::shared_ptr<const CBlock> pblock;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
 
-    if (!ReadBlockFromDisk(block, pblockindex))
+    if (!ReadBlockFromDisk(pblock, pblockindex))
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+    const CBlock& block = *pblock;
 
     if (!fVerbose) {
         CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
@@ -515,6 +586,67 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
     return ret;
 }
 
+UniValue dumptxoutset(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset \"path\"\n"
+            "\nWrite the unspent transaction output set and the active chain's block index to a snapshot file.\n"
+            "The file can be loaded by a fresh node with -loadtxoutset.\n"
+            "Note this call may take some time.\n"
+
+            "\nArguments:\n"
+            "1. \"path\"    (string, required) path to the output file, relative to the data directory if not absolute\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"height\":n,              (numeric) The height of the snapshot block\n"
+            "  \"bestblock\": \"hex\",      (string) The hash of the snapshot block\n"
+            "  \"coins_written\": n,      (numeric) The number of transactions with unspent outputs written\n"
+            "  \"commitment\": \"hash\",    (string) The hash of all coin records, checked on load\n"
+            "  \"path\": \"path\"           (string) The absolute path of the snapshot file\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("dumptxoutset", "\"utxo.dat\"") + HelpExampleRpc("dumptxoutset", "\"utxo.dat\""));
+
+    boost::filesystem::path path(params[0].get_str());
+    if (!path.is_complete())
+        path = GetDataDir() / path;
+    if (boost::filesystem::exists(path))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Snapshot file already exists: " + path.string());
+
+    // Write to a temporary name so a partial file is never mistaken for a snapshot
+    boost::filesystem::path pathTmp = path;
+    pathTmp += ".incomplete";
+    CAutoFile fileout(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Unable to open snapshot file: " + pathTmp.string());
+
+    CCoinsSnapshotMetadata metadata;
+    {
+        LOCK(cs_main);
+        FlushStateToDisk();
+        if (!DumpUTXOSnapshot(fileout, metadata)) {
+            fileout.fclose();
+            boost::filesystem::remove(pathTmp);
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Failed to write snapshot");
+        }
+    }
+    FileCommit(fileout.Get());
+    fileout.fclose();
+    if (!RenameOver(pathTmp, path))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to rename snapshot file to " + path.string());
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("height", (int64_t)metadata.nHeight));
+    ret.push_back(Pair("bestblock", metadata.hashBlock.GetHex()));
+    ret.push_back(Pair("coins_written", (int64_t)metadata.nCoins));
+    ret.push_back(Pair("commitment", metadata.hashCommitment.GetHex()));
+    ret.push_back(Pair("path", path.string()));
+    return ret;
+}
+
 UniValue gettxout(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -798,9 +930,10 @@ UniValue getfeeinfo(const UniValue& params, bool fHelp)
     int64_t nTotal = 0;
     for (int i = nStartHeight; i <= nBestHeight; i++) {
         CBlockIndex* pindex = chainActive[i];
-        CBlock block;
-        if (!ReadBlockFromDisk(block, pindex))
+        boost::shared_ptr<const CBlock> pblock;
+        if (!ReadBlockFromDisk(pblock, pindex))
             throw JSONRPCError(RPC_DATABASE_ERROR, "failed to read block from disk");
+        const CBlock& block = *pblock;
 
         CAmount nValueIn = 0;
         CAmount nValueOut = 0;
@@ -848,6 +981,7 @@ UniValue mempoolInfoToJSON()
     ret.push_back(Pair("size", (int64_t)mempool.size()));
     ret.push_back(Pair("bytes", (int64_t)mempool.GetTotalTxSize()));
     //ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    ret.push_back(Pair("sequence", (int64_t)mempool.GetSequence()));
 
     return ret;
 }
@@ -863,6 +997,7 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
             "{\n"
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
+            "  \"sequence\": xxxxx            (numeric) Sequence number of the last change, see getmempoolchanges\n"
             "}\n"
 
             "\nExamples:\n" +
@@ -871,6 +1006,25 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
     return mempoolInfoToJSON();
 }
 
+UniValue savemempool(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "savemempool\n"
+            "\nDumps the mempool to disk, so that it is reloaded on the next start.\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("savemempool", "") + HelpExampleRpc("savemempool", ""));
+
+    if (!fMempoolLoaded)
+        throw JSONRPCError(RPC_MISC_ERROR, "The mempool was not loaded yet");
+
+    if (!DumpMempool())
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to dump mempool to disk");
+
+    return NullUniValue;
+}
+
 UniValue invalidateblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
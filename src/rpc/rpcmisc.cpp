@@ -495,11 +495,11 @@ UniValue getforkstatus(const UniValue& params, bool fHelp)
     for (int i = 0; i < BlocksToMeasure && tip != NULL; i++)
     {
         if (tip->nHeight < 1) break;
-        CBlock pblock;
+        boost::shared_ptr<const CBlock> pblock;
         if (!ReadBlockFromDisk(pblock, tip))
             return LogPrintf("Failed to read block");
 
-        CScript script = pblock.vtx[1].vout.back().scriptPubKey;
+        CScript script = pblock->vtx[1].vout.back().scriptPubKey;
         CScript::const_iterator it = script.begin();
         opcodetype opcode;
 
@@ -79,6 +79,24 @@ static void CopyNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+static UniValue MsgStatsToJSON(const mapMsgCmdStats& mapStats)
+{
+    UniValue ret(UniValue::VOBJ);
+    for (mapMsgCmdStats::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it) {
+        const CNetMsgStats& msgstats = it->second;
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("recvcount", msgstats.nRecvCount));
+        obj.push_back(Pair("recvbytes", msgstats.nRecvBytes));
+        obj.push_back(Pair("sendcount", msgstats.nSendCount));
+        obj.push_back(Pair("sendbytes", msgstats.nSendBytes));
+        obj.push_back(Pair("processtime", msgstats.nProcessTime));
+        obj.push_back(Pair("maxprocesstime", msgstats.nMaxProcessTime));
+        obj.push_back(Pair("locktime", msgstats.nLockTime));
+        ret.push_back(Pair(it->first, obj));
+    }
+    return ret;
+}
+
 UniValue getpeerinfo(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -111,7 +129,14 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"blockwindow\": n,          (numeric) The number of blocks we ask from this peer at once, sized to its pace\n"
+            "    \"blocktime\": n,            (numeric) The average time in milliseconds this peer took per block we asked for\n"
+            "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"
+            "    \"msgstats\": {              (json object) Traffic and processing time per message type, see getnetmsgstats\n"
+            "      \"command\": {...},\n"
+            "      ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -160,8 +185,11 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            obj.push_back(Pair("blockwindow", statestats.nBlocksInTransitLimit));
+            obj.push_back(Pair("blocktime", statestats.nAvgBlockTime / 1000));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
+        obj.push_back(Pair("msgstats", MsgStatsToJSON(stats.mapMsgStats)));
 
         ret.push_back(obj);
     }
@@ -370,6 +398,36 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     return obj;
 }
 
+UniValue getnetmsgstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getnetmsgstats\n"
+            "\nReturns traffic and processing time per message type, over all peers since startup.\n"
+            "Received messages with a command we don't know are counted under \"" + NET_MESSAGE_COMMAND_OTHER + "\".\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"command\": {                (json object) The message type\n"
+            "    \"recvcount\": n,           (numeric) Number of messages received and processed\n"
+            "    \"recvbytes\": n,           (numeric) Bytes received, including message headers\n"
+            "    \"sendcount\": n,           (numeric) Number of messages sent\n"
+            "    \"sendbytes\": n,           (numeric) Bytes sent, including message headers\n"
+            "    \"processtime\": n,         (numeric) Total time in microseconds spent processing received messages\n"
+            "    \"maxprocesstime\": n,      (numeric) Longest time in microseconds spent processing one message\n"
+            "    \"locktime\": n             (numeric) Total time in microseconds cs_main was held while processing them\n"
+            "  },\n"
+            "  ...\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getnetmsgstats", "") + HelpExampleRpc("getnetmsgstats", ""));
+
+    mapMsgCmdStats mapStats;
+    GetNetMsgStats(mapStats);
+    return MsgStatsToJSON(mapStats);
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
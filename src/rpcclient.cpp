@@ -95,6 +95,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"verifychain", 1},
         {"keypoolrefill", 0},
         {"getrawmempool", 0},
+        {"getmempoolchanges", 0},
         {"estimatefee", 0},
         {"estimatepriority", 0},
         {"prioritisetransaction", 1},
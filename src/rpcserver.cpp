@@ -301,6 +301,7 @@ static const CRPCCommand vRPCCommands[] =
     {"network",               "getaddednodeinfo",           &getaddednodeinfo,          true,     true,     false},
     {"network",               "getconnectioncount",         &getconnectioncount,        true,     false,    false},
     {"network",               "getnettotals",               &getnettotals,              true,     true,     false},
+    {"network",               "getnetmsgstats",             &getnetmsgstats,            true,     true,     false},
     {"network",               "getnetworkinfo",             &getnetworkinfo,            true,     false,    false},
     {"network",               "getonion",                   &getonion,                  true,     false,    false},
     {"network",               "getpeerinfo",                &getpeerinfo,               true,     false,    false},
@@ -315,14 +316,17 @@ static const CRPCCommand vRPCCommands[] =
     {"blockchain",            "getblockhash",               &getblockhash,              true,     false,    false},
     {"blockchain",            "getblockheader",             &getblockheader,            false,    false,    false},
     {"blockchain",            "getchaintips",               &getchaintips,              true,     false,    false},
+    {"blockchain",            "dumptxoutset",               &dumptxoutset,              true,     false,    false},
     {"blockchain",            "getdifficulty",              &getdifficulty,             true,     false,    false},
     {"blockchain",            "getfeeinfo",                 &getfeeinfo,                true,     false,    false},
+    {"blockchain",            "getmempoolchanges",          &getmempoolchanges,         true,     true,     false},
     {"blockchain",            "getmempoolinfo",             &getmempoolinfo,            true,     true,     false},
     {"blockchain",            "getrawmempool",              &getrawmempool,             true,     false,    false},
     {"blockchain",            "gettxout",                   &gettxout,                  true,     false,    false},
     {"blockchain",            "gettxoutsetinfo",            &gettxoutsetinfo,           true,     false,    false},
     {"blockchain",            "invalidateblock",            &invalidateblock,           true,     true,     false},
     {"blockchain",            "reconsiderblock",            &reconsiderblock,           true,     true,     false},
+    {"blockchain",            "savemempool",                &savemempool,               true,     true,     false},
     {"blockchain",            "verifychain",                &verifychain,               true,     false,    false},
     {"blockchain",            "getchaintxstats",            &getchaintxstats,           true,     false,    false},
 
@@ -284,9 +284,23 @@ public:
 
     void GetAndClear(CSerializeData& data)
     {
+        if (data.empty() && nReadPos == 0) {
+            // Hand over the storage instead of copying it
+            data.swap(vch);
+            return;
+        }
         data.insert(data.end(), begin(), end());
         clear();
     }
+
+    /** Make an empty stream write into data's storage, to reuse memory that is already allocated */
+    void Reuse(CSerializeData& data)
+    {
+        assert(empty());
+        data.clear();
+        vch.swap(data);
+        nReadPos = 0;
+    }
     
     /**
      * XOR the contents of this stream with a certain key.
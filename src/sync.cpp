@@ -13,6 +13,28 @@
 #include <boost/foreach.hpp>
 #include <boost/thread.hpp>
 
+static boost::thread_specific_ptr<int64_t> lockHoldTime;
+
+void CCriticalSection::TimedLocked()
+{
+    if (nTimedDepth++ == 0)
+        nTimedSince = GetTimeMicros();
+}
+
+void CCriticalSection::TimedUnlocking()
+{
+    if (--nTimedDepth > 0)
+        return;
+    if (lockHoldTime.get() == NULL)
+        lockHoldTime.reset(new int64_t(0));
+    *lockHoldTime += GetTimeMicros() - nTimedSince;
+}
+
+int64_t GetLockHoldTime()
+{
+    return lockHoldTime.get() ? *lockHoldTime : 0;
+}
+
 #ifdef DEBUG_LOCKCONTENTION
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine)
 {
@@ -92,12 +92,50 @@ void static inline DeleteLock(void* cs) {}
  */
 class CCriticalSection : public AnnotatedMixin<boost::recursive_mutex>
 {
+private:
+    //! Whether the time this lock is held is added to GetLockHoldTime() of the holding thread
+    bool fTimed;
+    //! Recursion depth and time of the outermost lock, only touched by the holding thread
+    int nTimedDepth;
+    int64_t nTimedSince;
+
+    void TimedLocked();
+    void TimedUnlocking();
+
 public:
+    explicit CCriticalSection(bool fTimedIn = false) : fTimed(fTimedIn), nTimedDepth(0), nTimedSince(0) {}
+
     ~CCriticalSection() {
         DeleteLock((void*)this);
     }
+
+    void lock() EXCLUSIVE_LOCK_FUNCTION()
+    {
+        AnnotatedMixin<boost::recursive_mutex>::lock();
+        if (fTimed)
+            TimedLocked();
+    }
+
+    void unlock() UNLOCK_FUNCTION()
+    {
+        if (fTimed)
+            TimedUnlocking();
+        AnnotatedMixin<boost::recursive_mutex>::unlock();
+    }
+
+    bool try_lock() EXCLUSIVE_TRYLOCK_FUNCTION(true)
+    {
+        if (!AnnotatedMixin<boost::recursive_mutex>::try_lock())
+            return false;
+        if (fTimed)
+            TimedLocked();
+        return true;
+    }
 };
 
+/** Total time (in microseconds) the calling thread held critical sections constructed as timed */
+int64_t GetLockHoldTime();
+
 /** Wrapped boost mutex: supports waiting but not recursive locking */
 typedef AnnotatedMixin<boost::mutex> CWaitableCriticalSection;
 
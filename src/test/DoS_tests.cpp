@@ -23,13 +23,17 @@
 // Tests this internal-to-main.cpp method:
 extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxBytes);
 struct COrphanTx {
-    CTransaction tx;
+    CTransactionRef tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nTxSize;
+    size_t nPeerPos;
 };
-extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern boost::unordered_map<uint256, COrphanTx, CCoinsKeyHasher> mapOrphanTransactions;
+extern boost::unordered_map<COutPoint, std::vector<uint256>, COutPointHasher> mapOrphanTransactionsByPrev;
+extern size_t nOrphanBytes;
 
 CService ip(uint32_t i)
 {
@@ -105,11 +109,9 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
 
 CTransaction RandomOrphan()
 {
-    std::map<uint256, COrphanTx>::iterator it;
-    it = mapOrphanTransactions.lower_bound(GetRandHash());
-    if (it == mapOrphanTransactions.end())
-        it = mapOrphanTransactions.begin();
-    return it->second.tx;
+    boost::unordered_map<uint256, COrphanTx, CCoinsKeyHasher>::iterator it = mapOrphanTransactions.begin();
+    std::advance(it, GetRand(mapOrphanTransactions.size()));
+    return *it->second.tx;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -184,13 +186,41 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     }
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
+    LimitOrphanTxSize(40, std::numeric_limits<size_t>::max());
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, std::numeric_limits<size_t>::max());
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    size_t nHalfBytes = nOrphanBytes / 2;
+    LimitOrphanTxSize(10, nHalfBytes);
+    BOOST_CHECK(nOrphanBytes <= nHalfBytes);
+    LimitOrphanTxSize(0, std::numeric_limits<size_t>::max());
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK_EQUAL(nOrphanBytes, 0U);
+
+    // A peer flooding orphans only evicts its own:
+    for (int i = 0; i < 25; i++)
+    {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.n = 0;
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].scriptSig << OP_1;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1*CENT;
+        tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+        AddOrphanTx(tx, i < 5 ? 100 : 101);
+    }
+    LimitOrphanTxSize(10, std::numeric_limits<size_t>::max());
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 10U);
+    size_t nFromPeer = 0;
+    for (boost::unordered_map<uint256, COrphanTx, CCoinsKeyHasher>::iterator it = mapOrphanTransactions.begin(); it != mapOrphanTransactions.end(); ++it)
+        nFromPeer += it->second.fromPeer == 100;
+    BOOST_CHECK_EQUAL(nFromPeer, 5U);
+    EraseOrphansFor(100);
+    EraseOrphansFor(101);
+    BOOST_CHECK(mapOrphanTransactions.empty());
 }
 
 BOOST_AUTO_TEST_SUITE_END()
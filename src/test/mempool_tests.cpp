@@ -99,4 +99,119 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAncestorStateTest)
+{
+    // Test the ancestor state and the ancestor fee rate index
+
+    // A parent paying no fee with a child paying for both:
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 33000LL;
+
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout.hash = txParent.GetHash();
+    txChild.vin[0].prevout.n = 0;
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 23000LL;
+
+    // An unrelated transaction paying a small fee:
+    CMutableTransaction txOther;
+    txOther.vin.resize(1);
+    txOther.vin[0].scriptSig = CScript() << OP_12;
+    txOther.vout.resize(1);
+    txOther.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txOther.vout[0].nValue = 33000LL;
+
+    CTxMemPool testPool(CFeeRate(0));
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, 0, 0.0, 1));
+    testPool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 10000LL, 0, 0.0, 1));
+    testPool.addUnchecked(txOther.GetHash(), CTxMemPoolEntry(txOther, 1000LL, 0, 0.0, 1));
+
+    CTxMemPool::txiter parentIt = testPool.mapTx.find(txParent.GetHash());
+    CTxMemPool::txiter childIt = testPool.mapTx.find(txChild.GetHash());
+    BOOST_CHECK_EQUAL(parentIt->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(childIt->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(childIt->GetSizeWithAncestors(), parentIt->GetTxSize() + childIt->GetTxSize());
+    BOOST_CHECK_EQUAL(childIt->GetModFeesWithAncestors(), 10000LL);
+
+    // The child package has the best fee rate, the lone parent the worst:
+    CTxMemPool::indexed_transaction_set::nth_index<4>::type::iterator it = testPool.mapTx.get<4>().begin();
+    BOOST_CHECK(it->GetTx().GetHash() == txChild.GetHash());
+    ++it;
+    BOOST_CHECK(it->GetTx().GetHash() == txOther.GetHash());
+    ++it;
+    BOOST_CHECK(it->GetTx().GetHash() == txParent.GetHash());
+
+    // Fee deltas on the parent reach the ancestor state of the child:
+    testPool.PrioritiseTransaction(txParent.GetHash(), txParent.GetHash().ToString(), 0.0, 5000LL);
+    BOOST_CHECK_EQUAL(childIt->GetModFeesWithAncestors(), 15000LL);
+    testPool.ClearPrioritisation(txParent.GetHash());
+
+    // Removing the parent for a block leaves the child without ancestors:
+    std::list<CTransaction> removed;
+    testPool.remove(txParent, removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(childIt->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(childIt->GetSizeWithAncestors(), childIt->GetTxSize());
+    BOOST_CHECK_EQUAL(childIt->GetModFeesWithAncestors(), 10000LL);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolChangeLogTest)
+{
+    // Test the sequence numbered change log
+
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 33000LL;
+
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout.hash = txParent.GetHash();
+    txChild.vin[0].prevout.n = 0;
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 23000LL;
+
+    CTxMemPool testPool(CFeeRate(0));
+    std::vector<CMemPoolChange> vChanges;
+    uint64_t nSequence;
+    BOOST_CHECK(testPool.GetChangesSince(0, vChanges, nSequence));
+    BOOST_CHECK(vChanges.empty());
+    BOOST_CHECK_EQUAL(nSequence, 0);
+
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, 0, 0.0, 1));
+    testPool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 0, 0, 0.0, 1));
+    BOOST_CHECK_EQUAL(testPool.GetSequence(), 2);
+
+    std::list<CTransaction> removed;
+    testPool.remove(txParent, removed, true, MEMPOOL_REMOVAL_CONFLICT);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    BOOST_CHECK_EQUAL(testPool.GetSequence(), 4);
+
+    BOOST_CHECK(testPool.GetChangesSince(1, vChanges, nSequence));
+    BOOST_CHECK_EQUAL(nSequence, 4);
+    BOOST_CHECK_EQUAL(vChanges.size(), 3);
+    BOOST_CHECK(vChanges[0].fAdded && vChanges[0].txid == txChild.GetHash());
+    BOOST_CHECK(!vChanges[1].fAdded && vChanges[1].reason == MEMPOOL_REMOVAL_CONFLICT);
+    BOOST_CHECK_EQUAL(vChanges[2].nSequence, 4);
+
+    // Asking for the future is refused, so is anything from before a clear
+    BOOST_CHECK(!testPool.GetChangesSince(5, vChanges, nSequence));
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, 0, 0.0, 1));
+    testPool.clear();
+    BOOST_CHECK(!testPool.GetChangesSince(4, vChanges, nSequence));
+    BOOST_CHECK(testPool.GetChangesSince(testPool.GetSequence(), vChanges, nSequence));
+    BOOST_CHECK(vChanges.empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -159,6 +159,19 @@ BOOST_AUTO_TEST_CASE(insert_delete)
     CSerializeData d;
     ss.GetAndClear(d);
     BOOST_CHECK_EQUAL(ss.size(), 0);
+    BOOST_CHECK_EQUAL(d.size(), 4);
+    BOOST_CHECK_EQUAL(d[3], (char)0xff);
+
+    // Reuse writes into the given buffer's storage, GetAndClear hands it back
+    size_t nCapacity = d.capacity();
+    ss.Reuse(d);
+    BOOST_CHECK(d.empty());
+    ss << (char)42;
+    CSerializeData d2;
+    ss.GetAndClear(d2);
+    BOOST_CHECK_EQUAL(d2.size(), 1);
+    BOOST_CHECK_EQUAL(d2[0], 42);
+    BOOST_CHECK(d2.capacity() >= nCapacity);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
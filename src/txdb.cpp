@@ -100,6 +100,14 @@ bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
     return Write(make_pair(DB_BLOCK_INDEX, blockindex.GetBlockHash()), blockindex);
 }
 
+bool CBlockTreeDB::WriteBlockIndexes(const std::vector<CDiskBlockIndex>& vindex)
+{
+    CLevelDBBatch batch(&GetObfuscateKey());
+    for (std::vector<CDiskBlockIndex>::const_iterator it = vindex.begin(); it != vindex.end(); it++)
+        batch.Write(make_pair(DB_BLOCK_INDEX, it->GetBlockHash()), *it);
+    return WriteBatch(batch, true);
+}
+
 bool CBlockTreeDB::WriteBlockFileInfo(int nFile, const CBlockFileInfo& info)
 {
     return Write(make_pair(DB_BLOCK_FILES, nFile), info);
@@ -183,6 +191,71 @@ bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
     return true;
 }
 
+bool CCoinsViewDB::DumpSnapshot(CAutoFile& fileout, uint64_t& nCoins, uint256& hashCommitment) const
+{
+    /* Same const-cast as in GetStats(): we only read from the iterator. */
+    boost::scoped_ptr<CLevelDBIterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
+    pcursor->Seek(make_pair(DB_COINS, uint256(0)));
+
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    nCoins = 0;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            std::pair<char, uint256> key;
+            CCoins coins;
+            if (!pcursor->GetKey(key) || key.first != DB_COINS)
+                break;
+            if (!pcursor->GetValue(coins))
+                return error("%s : unable to read value", __func__);
+            fileout << key.second << coins;
+            ss << key.second << coins;
+            nCoins++;
+            pcursor->Next();
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    hashCommitment = ss.GetHash();
+    return true;
+}
+
+bool CCoinsViewDB::LoadSnapshot(CAutoFile& filein, const CCoinsSnapshotMetadata& metadata)
+{
+    // Records were written in chainstate key order, so every batch lands as a
+    // sorted run and LevelDB does not have to shuffle keys between levels.
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    CLevelDBBatch batch(&db.GetObfuscateKey());
+    size_t nBatchSize = 0;
+    for (uint64_t i = 0; i < metadata.nCoins; i++) {
+        boost::this_thread::interruption_point();
+        uint256 txid;
+        CCoins coins;
+        try {
+            filein >> txid >> coins;
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error at coin %u - %s", __func__, i, e.what());
+        }
+        ss << txid << coins;
+        BatchWriteCoins(batch, txid, coins);
+        nBatchSize += 32 + coins.GetSerializeSize(SER_DISK, CLIENT_VERSION);
+        if (nBatchSize >= COINS_SNAPSHOT_BATCH_SIZE) {
+            if (!db.WriteBatch(batch))
+                return false;
+            batch.Clear();
+            nBatchSize = 0;
+            LogPrintf("Loading UTXO snapshot... %u/%u coins\n", i + 1, metadata.nCoins);
+        }
+    }
+
+    // Only move the best block marker once the whole set has been checked
+    // against the commitment; without it the chainstate is treated as empty.
+    if (ss.GetHash() != metadata.hashCommitment)
+        return error("%s : commitment mismatch (expected %s, got %s)", __func__, metadata.hashCommitment.ToString(), ss.GetHash().ToString());
+    BatchWriteHashBestChain(batch, metadata.hashBlock);
+    return db.WriteBatch(batch, true);
+}
+
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo)
 {
     CLevelDBBatch batch(&GetObfuscateKey());
@@ -272,78 +345,118 @@ bool CBlockTreeDB::ReadInt(const std::string& name, int& nValue)
     return Read(std::make_pair('I', name), nValue);
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts()
-{    
-    boost::scoped_ptr<CLevelDBIterator> pcursor(NewIterator());
+namespace {
 
-    pcursor->Seek(make_pair(DB_BLOCK_INDEX, uint256()));
+/**
+ * State shared by the LoadBlockIndexGuts workers. Each worker walks the block
+ * index keys whose hash starts with a byte in [nBegin, nEnd) with its own
+ * iterator; decoding, hashing and the proof of work check run in parallel,
+ * only linking the entry into mapBlockIndex is serialized through cs.
+ */
+struct CBlockIndexLoadState {
+    boost::mutex cs;
+    bool fFailed;
+    std::string strError;
 
-    // Load mapBlockIndex
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        try {
+    CBlockIndexLoadState() : fFailed(false) {}
+
+    void Fail(const std::string& strErrorIn)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (!fFailed)
+            strError = strErrorIn;
+        fFailed = true;
+    }
+};
+
+void LoadBlockIndexRange(CBlockTreeDB* pdb, CBlockIndexLoadState* pstate, int nBegin, int nEnd)
+{
+    try {
+        boost::scoped_ptr<CLevelDBIterator> pcursor(pdb->NewIterator());
+
+        uint256 hashStart;
+        *hashStart.begin() = (unsigned char)nBegin;
+        pcursor->Seek(make_pair(DB_BLOCK_INDEX, hashStart));
+
+        for (; pcursor->Valid(); pcursor->Next()) {
             std::pair<char, uint256> key;
-            if (pcursor->GetKey(key) && key.first == DB_BLOCK_INDEX) {
-                CDiskBlockIndex diskindex;
-                if (pcursor->GetValue(diskindex)) {
-                    // Construct block index object=
-                    bool useLegacyCode = UseLegacyCode(diskindex.nHeight);
-                    if (fDebug)
-                        LogPrintf("%s(): Reading Block: %d \n", __func__,  diskindex.nHeight);
-                    
-                    CBlockIndex* pindexNew    = InsertBlockIndex(diskindex.GetBlockHash());
-                    pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-                    pindexNew->pnext          = useLegacyCode ? NULL : InsertBlockIndex(diskindex.hashNext);
-                    pindexNew->nHeight        = diskindex.nHeight;
-                    pindexNew->nFile          = diskindex.nFile;
-                    pindexNew->nDataPos       = diskindex.nDataPos;
-                    pindexNew->nUndoPos       = diskindex.nUndoPos;
-                    pindexNew->nVersion       = diskindex.nVersion;
-                    pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                    pindexNew->nTime          = diskindex.nTime;
-                    pindexNew->nBits          = diskindex.nBits;
-                    pindexNew->nNonce         = diskindex.nNonce;
-                    pindexNew->nBirthdayA     = diskindex.nBirthdayA;
-                    pindexNew->nBirthdayB     = diskindex.nBirthdayB;
-                    pindexNew->nStatus        = diskindex.nStatus;
-                    pindexNew->nTx            = diskindex.nTx;
-
-                    //Proof Of Stake
-                    pindexNew->nMint             = diskindex.nMint;
-                    pindexNew->nMoneySupply      = diskindex.nMoneySupply;
-                    pindexNew->nFlags            = diskindex.nFlags;
-                    pindexNew->nStakeModifier    = diskindex.nStakeModifier;
-                    pindexNew->nStakeModifierOld = diskindex.nStakeModifierOld;
-                    pindexNew->prevoutStake      = diskindex.prevoutStake;
-                    pindexNew->nStakeTime        = diskindex.nStakeTime;
-                    pindexNew->hashProofOfStake  = diskindex.hashProofOfStake;
-                    bool isProofOfStake = pindexNew->IsProofOfStake(); 
-
-                    if (!isProofOfStake && (pindexNew->nStatus & BLOCK_HAVE_DATA)) {
-                        if (useLegacyCode) {
-                            if (!CheckProofOfWork_Legacy(pindexNew->GetBlockHash(), pindexNew->nBits))
-                                return error("LoadBlockIndexGuts() : CheckProofOfWork failed: %s", pindexNew->ToString());
-                        } else {
-                            if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits))
-                                return error("LoadBlockIndexGuts() : CheckProofOfWork failed: %s", pindexNew->ToString());
-                        }
-                    }
-                    // ppcoin: build setStakeSeen
-                    if (!useLegacyCode && isProofOfStake)
-                        setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+            if (!pcursor->GetKey(key) || key.first != DB_BLOCK_INDEX || *key.second.begin() >= nEnd)
+                break; // finished loading this part of the block index
 
-                    pcursor->Next();
-               } else {
-                    return error("LoadBlockIndexGuts() : failed to read value");
-                }
-            } else {
-                break; // if shutdown requested or finished loading block index
+            CDiskBlockIndex diskindex;
+            if (!pcursor->GetValue(diskindex))
+                return pstate->Fail("failed to read value");
+
+            bool useLegacyCode = UseLegacyCode(diskindex.nHeight);
+            if (fDebug)
+                LogPrintf("%s(): Reading Block: %d \n", __func__, diskindex.nHeight);
+
+            const uint256 hash = diskindex.GetBlockHash();
+            bool isProofOfStake = diskindex.IsProofOfStake();
+
+            if (!isProofOfStake && (diskindex.nStatus & BLOCK_HAVE_DATA)) {
+                bool fValid = useLegacyCode ? CheckProofOfWork_Legacy(hash, diskindex.nBits) : CheckProofOfWork(hash, diskindex.nBits);
+                if (!fValid)
+                    return pstate->Fail(strprintf("CheckProofOfWork failed: %s", diskindex.ToString()));
             }
-        } catch (std::exception& e) {
-            LogPrintf("LoadBlockIndexGuts Error !!!");
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+
+            boost::unique_lock<boost::mutex> lock(pstate->cs);
+            if (pstate->fFailed)
+                return;
+
+            // Construct block index object
+            CBlockIndex* pindexNew    = InsertBlockIndex(hash);
+            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nDataPos       = diskindex.nDataPos;
+            pindexNew->nUndoPos       = diskindex.nUndoPos;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->nBirthdayA     = diskindex.nBirthdayA;
+            pindexNew->nBirthdayB     = diskindex.nBirthdayB;
+            pindexNew->nStatus        = diskindex.nStatus;
+            pindexNew->nTx            = diskindex.nTx;
+
+            //Proof Of Stake
+            pindexNew->nMint             = diskindex.nMint;
+            pindexNew->nMoneySupply      = diskindex.nMoneySupply;
+            pindexNew->nFlags            = diskindex.nFlags;
+            pindexNew->nStakeModifier    = diskindex.nStakeModifier;
+            pindexNew->nStakeModifierOld = diskindex.nStakeModifierOld;
+            pindexNew->prevoutStake      = diskindex.prevoutStake;
+            pindexNew->nStakeTime        = diskindex.nStakeTime;
+            pindexNew->hashProofOfStake  = diskindex.hashProofOfStake;
+
+            // ppcoin: build setStakeSeen
+            if (!useLegacyCode && isProofOfStake)
+                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
         }
+    } catch (const std::exception& e) {
+        pstate->Fail(strprintf("Deserialize or I/O error - %s", e.what()));
     }
+}
+
+} // anon namespace
+
+bool CBlockTreeDB::LoadBlockIndexGuts()
+{
+    // Block hashes are uniformly distributed, so splitting the key space on the
+    // first byte of the hash gives every worker a similar share of the index.
+    int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_BLOCK_INDEX_LOAD_THREADS));
+    int nRangeSize = (256 + nThreads - 1) / nThreads;
+
+    CBlockIndexLoadState state;
+    boost::thread_group threadGroup;
+    for (int nBegin = 0; nBegin < 256; nBegin += nRangeSize)
+        threadGroup.create_thread(boost::bind(&LoadBlockIndexRange, this, &state, nBegin, std::min(256, nBegin + nRangeSize)));
+    threadGroup.join_all();
+
+    if (state.fFailed)
+        return error("LoadBlockIndexGuts() : %s", state.strError);
 
     return true;
 }
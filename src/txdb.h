@@ -23,6 +23,63 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! Version of the UTXO snapshot format written by dumptxoutset
+static const uint32_t COINS_SNAPSHOT_VERSION = 1;
+//! Approximate amount of coin data committed per LevelDB batch while loading a snapshot
+static const size_t COINS_SNAPSHOT_BATCH_SIZE = 16 << 20;
+//! Maximum number of threads decoding the block index in LoadBlockIndexGuts
+static const int MAX_BLOCK_INDEX_LOAD_THREADS = 16;
+
+/**
+ * Header of a UTXO snapshot file (see dumptxoutset and -loadtxoutset).
+ *
+ * The header is followed by nBlockIndexEntries CDiskBlockIndex records (genesis
+ * up to hashBlock, in height order) and nCoins (txid, CCoins) records in
+ * chainstate key order. hashCommitment is the hash over all coin records.
+ * All fields have a fixed size so the header can be rewritten in place once
+ * the body has been streamed out.
+ */
+class CCoinsSnapshotMetadata
+{
+public:
+    CMessageHeader::MessageStartChars pchMessageStart;
+    uint32_t nSnapshotVersion;
+    uint256 hashBlock;
+    int32_t nHeight;
+    uint64_t nBlockIndexEntries;
+    uint64_t nCoins;
+    uint256 hashCommitment;
+
+    CCoinsSnapshotMetadata()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        memset(pchMessageStart, 0, sizeof(pchMessageStart));
+        nSnapshotVersion = COINS_SNAPSHOT_VERSION;
+        hashBlock = 0;
+        nHeight = -1;
+        nBlockIndexEntries = 0;
+        nCoins = 0;
+        hashCommitment = 0;
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(FLATDATA(pchMessageStart));
+        READWRITE(nSnapshotVersion);
+        READWRITE(hashBlock);
+        READWRITE(nHeight);
+        READWRITE(nBlockIndexEntries);
+        READWRITE(nCoins);
+        READWRITE(hashCommitment);
+    }
+};
 
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
@@ -38,6 +95,10 @@ public:
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
     bool GetStats(CCoinsStats& stats) const;
+    //! Stream every coin record to fileout, returning their count and commitment hash
+    bool DumpSnapshot(CAutoFile& fileout, uint64_t& nCoins, uint256& hashCommitment) const;
+    //! Bulk-load coin records written by DumpSnapshot and make metadata.hashBlock the best block
+    bool LoadSnapshot(CAutoFile& filein, const CCoinsSnapshotMetadata& metadata);
 };
 
 /** Access to the block database (blocks/index/) */
@@ -54,6 +115,7 @@ private:
 public:
     bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo);
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    bool WriteBlockIndexes(const std::vector<CDiskBlockIndex>& vindex);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo& fileinfo);
     bool WriteBlockFileInfo(int nFile, const CBlockFileInfo& fileinfo);
     bool ReadLastBlockFile(int& nFile);
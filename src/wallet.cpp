@@ -1315,11 +1315,12 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
             if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
                 ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(Params().GetTxData(), pindex) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH (CTransaction& tx, block.vtx) {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+            boost::shared_ptr<const CBlock> pblock;
+            if (ReadBlockFromDisk(pblock, pindex)) {
+                BOOST_FOREACH (const CTransaction& tx, pblock->vtx) {
+                    if (AddToWalletIfInvolvingMe(tx, pblock.get(), fUpdate))
+                        ret++;
+                }
             }
 
             pindex = chainActive.Next(pindex);
@@ -11,6 +11,7 @@
 
 class CBlockIndex;
 class CZMQAbstractNotifier;
+struct CMemPoolChange;
 
 class CZMQNotificationInterface : public CValidationInterface
 {
@@ -28,6 +29,9 @@ protected:
     void UpdatedBlockTip(const CBlockIndex *pindex);
     void NotifyTransactionLock(const CTransaction &tx);
 
+    // CTxMemPool::NotifyChange
+    void MempoolChanged(const CMemPoolChange &change);
+
 private:
     CZMQNotificationInterface();
 
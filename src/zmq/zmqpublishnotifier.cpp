@@ -16,6 +16,7 @@ static const char *MSG_HASHTXLOCK = "hashtxlock";
 static const char *MSG_RAWBLOCK   = "rawblock";
 static const char *MSG_RAWTX      = "rawtx";
 static const char *MSG_RAWTXLOCK = "rawtxlock";
+static const char *MSG_MEMPOOLSEQ = "mempoolseq";
 
 // Internal function to send multipart message
 static int zmq_send_multipart(void *sock, const void* data, size_t size, ...)
@@ -212,3 +213,16 @@ bool CZMQPublishRawTransactionLockNotifier::NotifyTransactionLock(const CTransac
     ss << transaction;
     return SendMessage(MSG_RAWTXLOCK, &(*ss.begin()), ss.size());
 }
+
+bool CZMQPublishMempoolSequenceNotifier::NotifyMempoolChange(const CMemPoolChange &change)
+{
+    LogPrint("zmq", "zmq: Publish mempoolseq %s %d\n", change.txid.GetHex(), change.nSequence);
+    /* txid, 'A' (added) or 'R' (removed), removal reason, LE 8byte mempool sequence number */
+    unsigned char data[32 + 1 + 1 + 8];
+    for (unsigned int i = 0; i < 32; i++)
+        data[31 - i] = change.txid.begin()[i];
+    data[32] = change.fAdded ? 'A' : 'R';
+    data[33] = (unsigned char)change.reason;
+    WriteLE64(&data[34], change.nSequence);
+    return SendMessage(MSG_MEMPOOLSEQ, data, sizeof(data));
+}
@@ -64,4 +64,10 @@ public:
     bool NotifyTransactionLock(const CTransaction &transaction);
 };
 
+class CZMQPublishMempoolSequenceNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifyMempoolChange(const CMemPoolChange &change);
+};
+
 #endif // BITCOIN_ZMQ_ZMQPUBLISHNOTIFIER_H